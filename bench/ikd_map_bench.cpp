@@ -0,0 +1,76 @@
+#include <ikd-Tree/ikd_Tree.h>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+/*
+  Times the mapping workload of one session on a KD_TREE: a Build of the initial map, batches of downsampled
+  Add_Points like the per-scan map increments, then single k = 5 Nearest_Search queries. Only the API that
+  predates the node pool is used, so the same source builds against older ikd-Tree revisions for comparison.
+  The reported times are the mean over the runs.
+
+    ikd_map_bench [--map 300000] [--batches 100] [--batch-points 3000] [--queries 100000] [--runs 5]
+*/
+namespace {
+
+PointVector random_points(mt19937 &gen, int num) {
+    uniform_real_distribution<float> horizontal(-50.0f, 50.0f), vertical(-5.0f, 5.0f);
+    PointVector points(num);
+    for (PointType &p : points) {
+        p.x = horizontal(gen);
+        p.y = horizontal(gen);
+        p.z = vertical(gen);
+        p.intensity = 0.0f;
+    }
+    return points;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    int map_num = 300000, batches = 100, batch_num = 3000, query_num = 100000, runs = 5;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string flag = argv[i];
+        int value = atoi(argv[i + 1]);
+        if (flag == "--map") map_num = value;
+        else if (flag == "--batches") batches = value;
+        else if (flag == "--batch-points") batch_num = value;
+        else if (flag == "--queries") query_num = value;
+        else if (flag == "--runs") runs = max(1, value);
+        else {
+            fprintf(stderr, "usage: %s [--map n] [--batches n] [--batch-points n] [--queries n] [--runs n]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    double build_s = 0.0, insert_s = 0.0, search_s = 0.0;
+    int tree_size = 0;
+    for (int run = 0; run < runs; run++) {
+        mt19937 gen(7);
+        KD_TREE *tree = new KD_TREE(0.5, 0.6, 0.2);
+        PointVector map = random_points(gen, map_num);
+        auto t_start = chrono::steady_clock::now();
+        tree->Build(map);
+        build_s += chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+
+        for (int b = 0; b < batches; b++) {
+            PointVector batch = random_points(gen, batch_num);
+            t_start = chrono::steady_clock::now();
+            tree->Add_Points(batch, true);
+            insert_s += chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+        }
+        // let the rebuild thread finish before the queries
+        usleep(200000);
+
+        PointVector queries = random_points(gen, query_num), nearest;
+        vector<float> dist;
+        t_start = chrono::steady_clock::now();
+        for (const PointType &q : queries) tree->Nearest_Search(q, 5, nearest, dist, 5.0);
+        search_s += chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+        tree_size = tree->size();
+        delete tree;
+    }
+    printf("map %d, %d x %d inserts, %d queries, %d runs, final size %d\n", map_num, batches, batch_num, query_num, runs, tree_size);
+    printf("build  %.3f s\ninsert %.3f s\nsearch %.3f s\n", build_s / runs, insert_s / runs, search_s / runs);
+    return 0;
+}
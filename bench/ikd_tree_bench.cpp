@@ -0,0 +1,85 @@
+#include <ikd-Tree/ikd_Tree.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <sstream>
+
+/*
+  Times KD_TREE::Build on a synthetic map for each combination of point count and set_build_threads value.
+  All builds of one point count reuse the same tree, the reported time is the median over the repetitions.
+
+    ikd_tree_bench [--points 1000000,5000000,20000000] [--threads 1,2,4,8] [--reps 3]
+*/
+namespace {
+
+vector<long> parse_list(const string &arg) {
+    vector<long> values;
+    stringstream ss(arg);
+    string item;
+    while (getline(ss, item, ',')) values.push_back(stol(item));
+    return values;
+}
+
+/* Points spread like an accumulated LiDAR map: wide in x/y, a few meters in z */
+PointVector synthetic_map(long num, unsigned seed) {
+    mt19937 gen(seed);
+    uniform_real_distribution<float> horizontal(-200.0f, 200.0f), vertical(-2.0f, 10.0f);
+    PointVector points(num);
+    for (PointType &p : points) {
+        p.x = horizontal(gen);
+        p.y = horizontal(gen);
+        p.z = vertical(gen);
+        p.intensity = 0.0f;
+    }
+    return points;
+}
+
+double median(vector<double> values) {
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    vector<long> point_nums = {1000000, 5000000, 20000000};
+    vector<long> thread_nums = {1, 2, 4, 8};
+    int reps = 3;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string flag = argv[i];
+        if (flag == "--points") point_nums = parse_list(argv[i + 1]);
+        else if (flag == "--threads") thread_nums = parse_list(argv[i + 1]);
+        else if (flag == "--reps") reps = max(1, atoi(argv[i + 1]));
+        else {
+            fprintf(stderr, "usage: %s [--points n,...] [--threads n,...] [--reps n]\n", argv[0]);
+            return 1;
+        }
+    }
+#ifndef MP_EN
+    printf("built without MP_EN, set_build_threads has no effect\n");
+#endif
+
+    printf("%10s %8s %12s %8s\n", "points", "threads", "build [ms]", "speedup");
+    for (long num : point_nums) {
+        PointVector points = synthetic_map(num, 1);
+        // one untimed build first so that every timed one takes its nodes from an already grown pool
+        KD_TREE *tree = new KD_TREE(0.5, 0.6, 0.2);
+        tree->Build(points);
+        double serial_ms = 0.0;
+        for (long threads : thread_nums) {
+            tree->set_build_threads(threads);
+            vector<double> build_ms;
+            for (int rep = 0; rep < reps; rep++) {
+                auto t_start = chrono::steady_clock::now();
+                tree->Build(points);
+                build_ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - t_start).count());
+            }
+            double build = median(build_ms);
+            if (serial_ms == 0.0) serial_ms = build;
+            printf("%10ld %8ld %12.1f %8.2f\n", num, threads, build, serial_ms / build);
+            fflush(stdout);
+        }
+        delete tree;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * Fixed capacity FIFO handing work from one pipeline stage to the next. When full, push() either blocks
+ * the producer or drops the oldest element. pop() blocks until an element arrives or the queue is closed,
+ * the consumer calls task_done() after finishing an element so that wait_done() can wait for a drain.
+ */
+template<typename T>
+class BoundedQueue
+{
+  public:
+    explicit BoundedQueue(size_t capacity = 4) : cap(capacity > 0 ? capacity : 1) {}
+
+    void set_capacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mtx);
+        cap = capacity > 0 ? capacity : 1;
+        cv_not_full.notify_all();
+    }
+
+    /* Returns false if the element was rejected because the queue is closed */
+    bool push(T &&item, bool drop_oldest) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (drop_oldest) {
+            if (!closed && q.size() >= cap) {
+                q.pop_front();
+                unfinished--;
+                dropped_num++;
+            }
+        } else {
+            cv_not_full.wait(lock, [this] { return closed || q.size() < cap; });
+        }
+        if (closed) return false;
+        q.push_back(std::move(item));
+        unfinished++;
+        cv_not_empty.notify_one();
+        return true;
+    }
+
+    /* Returns false once the queue is closed */
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv_not_empty.wait(lock, [this] { return closed || !q.empty(); });
+        if (closed) return false;
+        item = std::move(q.front());
+        q.pop_front();
+        cv_not_full.notify_one();
+        return true;
+    }
+
+    void task_done() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (--unfinished == 0) cv_done.notify_all();
+    }
+
+    void wait_done() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv_done.wait(lock, [this] { return closed || unfinished == 0; });
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        cv_not_empty.notify_all();
+        cv_not_full.notify_all();
+        cv_done.notify_all();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return q.size();
+    }
+
+    size_t dropped() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return dropped_num;
+    }
+
+  private:
+    std::deque<T> q;
+    std::mutex mtx;
+    std::condition_variable cv_not_empty, cv_not_full, cv_done;
+    size_t cap;
+    size_t unfinished = 0, dropped_num = 0;
+    bool closed = false;
+};
+
+#endif
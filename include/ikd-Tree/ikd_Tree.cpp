@@ -1,4 +1,12 @@
 #include "ikd_Tree.h"
+#include <algorithm>
+#include <new>
+#include <climits>
+#include <stdlib.h>
+#ifdef MP_EN
+#include <omp.h>
+#include <parallel/algorithm>
+#endif
 
 /*
 Description: ikd-Tree: an incremental k-d tree for robotic applications 
@@ -36,6 +44,22 @@ void KD_TREE::set_downsample_param(float downsample_param){
     downsample_size = downsample_param;
 }
 
+/* Workers for building the initial tree and large rebuilt subtrees, 1 builds on the calling thread */
+void KD_TREE::set_build_threads(int threads){
+    build_threads = max(1, threads);
+}
+
+/*
+  Approximate k-NN for Nearest_Search and Nearest_Search_Batch: a subtree is only searched if it may hold a
+  point closer than the current k-th distance divided by (1 + epsilon), and once k points are found a query
+  stops after max_visits nodes. epsilon = 0 and max_visits <= 0 give the exact search.
+*/
+void KD_TREE::set_approximate_search(float epsilon, int max_visits){
+    epsilon = max(0.0f, epsilon);
+    search_eps_scale = (1.0f + epsilon) * (1.0f + epsilon);
+    search_max_visits = max_visits > 0 ? max_visits : -1;
+}
+
 void KD_TREE::InitializeKDTree(float delete_param, float balance_param, float box_length){
     Set_delete_criterion_param(delete_param);
     Set_balance_criterion_param(balance_param);
@@ -159,7 +183,7 @@ void KD_TREE::start_thread(){
     pthread_mutex_init(&rebuild_logger_mutex_lock, NULL);
     pthread_mutex_init(&points_deleted_rebuild_mutex_lock, NULL); 
     pthread_mutex_init(&working_flag_mutex, NULL);
-    pthread_mutex_init(&search_flag_mutex, NULL);
+    pthread_mutex_init(&stats_mutex_lock, NULL);
     pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void*) this);
     printf("Multi thread started \n");    
 }
@@ -174,7 +198,7 @@ void KD_TREE::stop_thread(){
     pthread_mutex_destroy(&rebuild_ptr_mutex_lock);
     pthread_mutex_destroy(&points_deleted_rebuild_mutex_lock);
     pthread_mutex_destroy(&working_flag_mutex);
-    pthread_mutex_destroy(&search_flag_mutex);     
+    pthread_mutex_destroy(&stats_mutex_lock);
 }
 
 void * KD_TREE::multi_thread_ptr(void * arg){
@@ -183,6 +207,30 @@ void * KD_TREE::multi_thread_ptr(void * arg){
     return nullptr;    
 }    
 
+/*
+  Searches never lock: they count themselves in the reader slot of the current epoch parity for as long as
+  they hold node pointers, and re-check the epoch so that a search which read a stale epoch cannot slip past
+  a drain. A replaced subtree is unlinked first, then the rebuild thread advances the epoch and waits for the
+  slot of the previous one to empty; searches that registered after that can only reach the new subtree.
+*/
+int KD_TREE::enter_search_epoch(){
+    while (true){
+        int slot = search_epoch.load() & 1;
+        search_readers[slot].fetch_add(1);
+        if (int(search_epoch.load() & 1) == slot) return slot;
+        search_readers[slot].fetch_sub(1);
+    }
+}
+
+void KD_TREE::exit_search_epoch(int slot){
+    search_readers[slot].fetch_sub(1);
+}
+
+void KD_TREE::wait_for_search_epoch(){
+    int slot = search_epoch.fetch_add(1) & 1;
+    while (search_readers[slot].load() != 0) usleep(1);
+}
+
 void KD_TREE::multi_thread_rebuild(){
     bool terminated = false;
     KD_TREE_NODE * father_ptr, ** new_node_ptr;
@@ -198,6 +246,7 @@ void KD_TREE::multi_thread_rebuild(){
                 printf("\n\n\n\n\n\n\n\n\n\n\n ERROR!!! \n\n\n\n\n\n\n\n\n");
             }
             rebuild_flag = true;
+            auto t_start = chrono::steady_clock::now();
             if (*Rebuild_Ptr == Root_Node) {
                 Treesize_tmp = Root_Node->TreeSize;
                 Validnum_tmp = Root_Node->TreeSize - Root_Node->invalid_point_num;
@@ -207,37 +256,25 @@ void KD_TREE::multi_thread_rebuild(){
             KD_TREE_NODE * old_root_node = (*Rebuild_Ptr);                            
             father_ptr = (*Rebuild_Ptr)->father_ptr;  
             PointVector ().swap(Rebuild_PCL_Storage);
-            // Lock Search 
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0){
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);             
-                pthread_mutex_lock(&search_flag_mutex);
-            }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
+            // Searches only read the nodes, so they keep running on the old subtree while it is flattened
             // Lock deleted points cache
             pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);    
             flatten(*Rebuild_Ptr, Rebuild_PCL_Storage, MULTI_THREAD_REC);
             // Unlock deleted points cache
             pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
-            // Unlock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);              
             pthread_mutex_unlock(&working_flag_mutex);   
             /* Rebuild and update missed operations*/
             Operation_Logger_Type Operation;
             KD_TREE_NODE * new_root_node = nullptr;  
             if (int(Rebuild_PCL_Storage.size()) > 0){
-                BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size()-1, Rebuild_PCL_Storage);
+                BuildTree_Parallel(&new_root_node, 0, Rebuild_PCL_Storage.size()-1, Rebuild_PCL_Storage);
                 // Rebuild has been done. Updates the blocked operations into the new tree
                 pthread_mutex_lock(&working_flag_mutex);
                 pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 int tmp_counter = 0;
                 while (!Rebuild_Logger.empty()){
                     Operation = Rebuild_Logger.front();
-                    max_queue_size = max(max_queue_size, Rebuild_Logger.size());
+                    max_queue_size = Rebuild_Logger.high_water();
                     Rebuild_Logger.pop();
                     pthread_mutex_unlock(&rebuild_logger_mutex_lock);                  
                     pthread_mutex_unlock(&working_flag_mutex);
@@ -250,27 +287,17 @@ void KD_TREE::multi_thread_rebuild(){
                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }  
             /* Replace to original tree*/          
-            // pthread_mutex_lock(&working_flag_mutex);
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0){
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);             
-                pthread_mutex_lock(&search_flag_mutex);
-            }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
+            // The new subtree is complete before it is linked, a search sees either the old or the new one
+            if (new_root_node != nullptr) new_root_node->father_ptr = father_ptr;
             if (father_ptr->left_son_ptr == *Rebuild_Ptr) {
-                father_ptr->left_son_ptr = new_root_node;
+                __atomic_store_n(&father_ptr->left_son_ptr, new_root_node, __ATOMIC_RELEASE);
             } else if (father_ptr->right_son_ptr == *Rebuild_Ptr){             
-                father_ptr->right_son_ptr = new_root_node;
+                __atomic_store_n(&father_ptr->right_son_ptr, new_root_node, __ATOMIC_RELEASE);
             } else {
                 throw "Error: Father ptr incompatible with current node\n";
             }
-            if (new_root_node != nullptr) new_root_node->father_ptr = father_ptr;
             (*Rebuild_Ptr) = new_root_node;
-            int valid_old = old_root_node->TreeSize-old_root_node->invalid_point_num;
-            int valid_new = new_root_node->TreeSize-new_root_node->invalid_point_num;
-            if (father_ptr == STATIC_ROOT_NODE) Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+            if (father_ptr == STATIC_ROOT_NODE) __atomic_store_n(&Root_Node, STATIC_ROOT_NODE->left_son_ptr, __ATOMIC_RELEASE);
             KD_TREE_NODE * update_root = *Rebuild_Ptr;
             while (update_root != nullptr && update_root != Root_Node){
                 update_root = update_root->father_ptr;
@@ -279,13 +306,16 @@ void KD_TREE::multi_thread_rebuild(){
                 if (update_root == update_root->father_ptr->right_son_ptr && update_root->father_ptr->need_push_down_to_right) break;
                 Update(update_root);
             }
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
             Rebuild_Ptr = nullptr;
             pthread_mutex_unlock(&working_flag_mutex);
             rebuild_flag = false;                     
-            /* Delete discarded tree nodes */
+            double rebuild_us = chrono::duration<double, micro>(chrono::steady_clock::now() - t_start).count();
+            pthread_mutex_lock(&stats_mutex_lock);
+            stats.thread_rebuild.record(rebuild_us);
+            stats.thread_rebuild_points += Rebuild_PCL_Storage.size();
+            pthread_mutex_unlock(&stats_mutex_lock);
+            /* Delete discarded tree nodes once no search can still be inside them */
+            wait_for_search_epoch();
             delete_tree_nodes(&old_root_node);
         } else {
             pthread_mutex_unlock(&working_flag_mutex);             
@@ -334,39 +364,34 @@ void KD_TREE::run_operation(KD_TREE_NODE ** root, Operation_Logger_Type operatio
 }
 
 void KD_TREE::Build(PointVector point_cloud){
+    auto t_start = chrono::steady_clock::now();
     if (Root_Node != nullptr){
         delete_tree_nodes(&Root_Node);
     }
     if (point_cloud.size() == 0) return;
-    STATIC_ROOT_NODE = new KD_TREE_NODE;
+    if (STATIC_ROOT_NODE != nullptr){
+        pthread_mutex_destroy(&STATIC_ROOT_NODE->push_down_mutex_lock);
+        node_pool.free(STATIC_ROOT_NODE);
+    }
+    STATIC_ROOT_NODE = node_pool.alloc();
     InitTreeNode(STATIC_ROOT_NODE); 
-    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size()-1, point_cloud);
+    BuildTree_Parallel(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size()-1, point_cloud);
     Update(STATIC_ROOT_NODE);
     STATIC_ROOT_NODE->TreeSize = 0;
     Root_Node = STATIC_ROOT_NODE->left_son_ptr;    
+    record_stats(nullptr, t_start, true);
 }
 
 void KD_TREE::Nearest_Search(PointType point, int k_nearest, PointVector& Nearest_Points, vector<float> & Point_Distance, double max_dist){   
+    auto t_start = chrono::steady_clock::now();
     MANUAL_HEAP q(2*k_nearest);
     q.clear();
     vector<float> ().swap(Point_Distance);
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
-        Search(Root_Node, k_nearest, point, q, max_dist);
-    } else {
-        pthread_mutex_lock(&search_flag_mutex);
-        while (search_mutex_counter == -1)
-        {
-            pthread_mutex_unlock(&search_flag_mutex);
-            usleep(1);
-            pthread_mutex_lock(&search_flag_mutex);
-        }
-        search_mutex_counter += 1;
-        pthread_mutex_unlock(&search_flag_mutex);  
-        Search(Root_Node, k_nearest, point, q, max_dist);  
-        pthread_mutex_lock(&search_flag_mutex);
-        search_mutex_counter -= 1;
-        pthread_mutex_unlock(&search_flag_mutex);      
-    }
+    int epoch_slot = enter_search_epoch();
+    int visit_start = search_max_visits > 0 ? search_max_visits : INT_MAX;
+    int visit_budget = visit_start;
+    Search(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), k_nearest, point, q, max_dist, visit_budget, nullptr);
+    exit_search_epoch(epoch_slot);
     int k_found = min(k_nearest,int(q.size()));
     PointVector ().swap(Nearest_Points);
     vector<float> ().swap(Point_Distance);
@@ -375,10 +400,116 @@ void KD_TREE::Nearest_Search(PointType point, int k_nearest, PointVector& Neares
         Point_Distance.insert(Point_Distance.begin(), q.top().dist);
         q.pop();
     }
+    double search_us = chrono::duration<double, micro>(chrono::steady_clock::now() - t_start).count();
+    search_counters.record(search_us, 1, visit_start - visit_budget);
     return;
 }
 
+void KD_TREE::Radius_Search(PointType point, const float radius, PointVector &Storage){
+    Storage.clear();
+    int epoch_slot = enter_search_epoch();
+    Search_by_radius(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), point, radius, Storage, nullptr);
+    exit_search_epoch(epoch_slot);
+}
+
+/* Interleaves the bits of three 10-bit cell indices into a 30-bit Morton code */
+static uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z){
+    auto spread = [](uint32_t v){
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v << 8)) & 0x0300F00F;
+        v = (v | (v << 4)) & 0x030C30C3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+}
+
+/*
+  Same results as calling Nearest_Search for every point. The queries are visited along a Morton curve, so
+  consecutive queries are spatial neighbours: the k-th distance from the current query to the result of the
+  previous one bounds its own k-th distance and is used to prefill the heap with sentinels, which prunes
+  the top of the tree right away instead of descending it with an empty heap. Each thread reuses one heap.
+*/
+void KD_TREE::Nearest_Search_Batch(const PointVector &points, int k_nearest, vector<PointVector> &Nearest_Points, vector<vector<float>> &Point_Distance, double max_dist){
+    int query_num = points.size();
+    Nearest_Points.resize(query_num);
+    Point_Distance.resize(query_num);
+    if (query_num == 0) return;
+    auto t_start = chrono::steady_clock::now();
+
+    float min_pt[3] = {INFINITY, INFINITY, INFINITY}, max_pt[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (const PointType &p : points){
+        min_pt[0] = min(min_pt[0], p.x); max_pt[0] = max(max_pt[0], p.x);
+        min_pt[1] = min(min_pt[1], p.y); max_pt[1] = max(max_pt[1], p.y);
+        min_pt[2] = min(min_pt[2], p.z); max_pt[2] = max(max_pt[2], p.z);
+    }
+    float extent = max(max(max_pt[0] - min_pt[0], max_pt[1] - min_pt[1]), max(max_pt[2] - min_pt[2], float(EPSS)));
+    float scale = 1023.0f / extent;
+    vector<pair<uint32_t, int>> order(query_num);
+    for (int i = 0; i < query_num; i++){
+        const PointType &p = points[i];
+        uint32_t cx = uint32_t(max(0.0f, min(1023.0f, (p.x - min_pt[0]) * scale)));
+        uint32_t cy = uint32_t(max(0.0f, min(1023.0f, (p.y - min_pt[1]) * scale)));
+        uint32_t cz = uint32_t(max(0.0f, min(1023.0f, (p.z - min_pt[2]) * scale)));
+        order[i] = make_pair(morton_code(cx, cy, cz), i);
+    }
+    sort(order.begin(), order.end());
+
+    #ifdef MP_EN
+        #pragma omp parallel num_threads(MP_PROC_NUM)
+    #endif
+    {
+        int tid = 0, thread_num = 1;
+        #ifdef MP_EN
+            tid = omp_get_thread_num();
+            thread_num = omp_get_num_threads();
+        #endif
+        int begin = int(int64_t(query_num) * tid / thread_num), end = int(int64_t(query_num) * (tid + 1) / thread_num);
+        MANUAL_HEAP q(2*k_nearest);
+        int prev = -1;
+        uint64_t nodes_visited = 0;
+        int epoch_slot = enter_search_epoch();
+        for (int n = begin; n < end; n++){
+            int idx = order[n].second;
+            const PointType &point = points[idx];
+            q.clear();
+            float bound = INFINITY;
+            // the approximate search could prune the real points behind the sentinels, so it starts empty
+            if (prev >= 0 && int(Nearest_Points[prev].size()) == k_nearest && search_eps_scale == 1.0f && search_max_visits < 0){
+                bound = 0.0f;
+                for (const PointType &seed : Nearest_Points[prev]) bound = max(bound, calc_dist(point, seed));
+                // at least k points lie within the bound, the margin keeps the sentinels strictly behind them
+                bound = bound * 1.0001f + 1e-6f;
+                for (int i = 0; i < k_nearest; i++) q.push(PointType_CMP(ZeroP, bound));
+            }
+            int visit_start = search_max_visits > 0 ? search_max_visits : INT_MAX;
+            int visit_budget = visit_start;
+            Search(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), k_nearest, point, q, max_dist, visit_budget, nullptr);
+            nodes_visited += visit_start - visit_budget;
+            PointVector &near_points = Nearest_Points[idx];
+            vector<float> &near_dist = Point_Distance[idx];
+            near_points.clear();
+            near_dist.clear();
+            while (q.size() > 0){
+                if (q.top().dist < bound){
+                    near_points.push_back(q.top().point);
+                    near_dist.push_back(q.top().dist);
+                }
+                q.pop();
+            }
+            reverse(near_points.begin(), near_points.end());
+            reverse(near_dist.begin(), near_dist.end());
+            prev = idx;
+        }
+        exit_search_epoch(epoch_slot);
+        search_counters.nodes_visited.fetch_add(nodes_visited, memory_order_relaxed);
+    }
+    double search_us = chrono::duration<double, micro>(chrono::steady_clock::now() - t_start).count();
+    search_counters.record(search_us, query_num, 0);
+}
+
 int KD_TREE::Add_Points(PointVector & PointToAdd, bool downsample_on){
+    auto t_start = chrono::steady_clock::now();
     int NewPointSize = PointToAdd.size();
     int tree_size = size();
     BoxPointType Box_of_Point;
@@ -452,6 +583,7 @@ int KD_TREE::Add_Points(PointVector & PointToAdd, bool downsample_on){
             }
         }
     }
+    record_stats(&KD_TREE_STATS::add_points, t_start, true);
     return tmp_counter;
 }
 
@@ -498,6 +630,7 @@ void KD_TREE::Delete_Points(PointVector & PointToDel){
 }
 
 int KD_TREE::Delete_Point_Boxes(vector<BoxPointType> & BoxPoints){
+    auto t_start = chrono::steady_clock::now();
     int tmp_counter = 0;
     for (int i=0;i < BoxPoints.size();i++){ 
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){               
@@ -516,6 +649,7 @@ int KD_TREE::Delete_Point_Boxes(vector<BoxPointType> & BoxPoints){
             pthread_mutex_unlock(&working_flag_mutex);
         }
     } 
+    record_stats(&KD_TREE_STATS::delete_boxes, t_start, true);
     return tmp_counter;
 }
 
@@ -533,54 +667,167 @@ void KD_TREE::acquire_removed_points(PointVector & removed_points){
     return;
 }
 
-void KD_TREE::BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage){
+/* Safe to call from any thread, the sizes are those after the last Build, Add_Points or Delete_Point_Boxes */
+KD_TREE_STATS KD_TREE::get_stats(){
+    pthread_mutex_lock(&stats_mutex_lock);
+    KD_TREE_STATS snapshot = stats;
+    pthread_mutex_unlock(&stats_mutex_lock);
+    search_counters.read(snapshot);
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    snapshot.pending_ops = Rebuild_Logger.size();
+    snapshot.pending_ops_high_water = Rebuild_Logger.high_water();
+    snapshot.log_bytes = Rebuild_Logger.bytes();
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+    node_pool.usage(snapshot.node_pool_bytes, snapshot.free_nodes);
+    return snapshot;
+}
+
+void KD_TREE::reset_stats(){
+    pthread_mutex_lock(&stats_mutex_lock);
+    KD_TREE_STATS cleared;
+    cleared.tree_size = stats.tree_size;
+    cleared.valid_num = stats.valid_num;
+    stats = cleared;
+    pthread_mutex_unlock(&stats_mutex_lock);
+    search_counters.clear();
+}
+
+/* Op is the latency to record the call in, or nullptr to only refresh the tree sizes */
+void KD_TREE::record_stats(KD_TREE_LATENCY KD_TREE_STATS::* op, chrono::steady_clock::time_point start, bool update_size){
+    double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    int tree_size = 0, valid_num = -1;
+    if (update_size){
+        tree_size = size();
+        valid_num = validnum();
+    }
+    pthread_mutex_lock(&stats_mutex_lock);
+    if (op != nullptr) (stats.*op).record(us);
+    if (update_size){
+        stats.tree_size = tree_size;
+        // unknown while the root is being rebuilt
+        if (valid_num >= 0) stats.valid_num = valid_num;
+    }
+    pthread_mutex_unlock(&stats_mutex_lock);
+}
+
+/* Nodes, if given, holds one preallocated node per point of [l, r], the node of Storage[i] is nodes[i-l] */
+void KD_TREE::BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage, KD_TREE_NODE ** nodes){
     if (l>r) return;
-    *root = new KD_TREE_NODE;
+    int mid = (l+r)>>1;
+    *root = nodes != nullptr ? nodes[mid-l] : node_pool.alloc();
     InitTreeNode(*root);
+    int div_axis = Division_Axis(l, r, Storage, false);
+    (*root)->division_axis = div_axis;
+    (*root)->point = Storage[mid]; 
+    KD_TREE_NODE * left_son = nullptr, * right_son = nullptr;
+    BuildTree(&left_son, l, mid-1, Storage, nodes);
+    BuildTree(&right_son, mid+1, r, Storage, nodes != nullptr ? nodes + (mid+1-l) : nullptr);  
+    (*root)->left_son_ptr = left_son;
+    (*root)->right_son_ptr = right_son;
+    Update((*root));  
+    return;
+}
+
+/* Selects the longest dimension of [l, r] as division axis and moves the median along it to the middle */
+int KD_TREE::Division_Axis(int l, int r, PointVector & Storage, bool parallel){
     int mid = (l+r)>>1;
     int div_axis = 0;
     int i;
     // Find the best division Axis
-    float min_value[3] = {INFINITY, INFINITY, INFINITY};
-    float max_value[3] = {-INFINITY, -INFINITY, -INFINITY};
-    float dim_range[3] = {0,0,0};
+    float min_x = INFINITY, min_y = INFINITY, min_z = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY, max_z = -INFINITY;
+    // an if(parallel) clause would still open a one-thread region for every node of a serial build
+    #ifdef MP_EN
+    if (parallel){
+        #pragma omp parallel for num_threads(build_threads) reduction(min:min_x,min_y,min_z) reduction(max:max_x,max_y,max_z)
+        for (i=l;i<=r;i++){
+            min_x = min(min_x, Storage[i].x);
+            min_y = min(min_y, Storage[i].y);
+            min_z = min(min_z, Storage[i].z);
+            max_x = max(max_x, Storage[i].x);
+            max_y = max(max_y, Storage[i].y);
+            max_z = max(max_z, Storage[i].z);
+        }
+    } else
+    #endif
     for (i=l;i<=r;i++){
-        min_value[0] = min(min_value[0], Storage[i].x);
-        min_value[1] = min(min_value[1], Storage[i].y);
-        min_value[2] = min(min_value[2], Storage[i].z);
-        max_value[0] = max(max_value[0], Storage[i].x);
-        max_value[1] = max(max_value[1], Storage[i].y);
-        max_value[2] = max(max_value[2], Storage[i].z);
+        min_x = min(min_x, Storage[i].x);
+        min_y = min(min_y, Storage[i].y);
+        min_z = min(min_z, Storage[i].z);
+        max_x = max(max_x, Storage[i].x);
+        max_y = max(max_y, Storage[i].y);
+        max_z = max(max_z, Storage[i].z);
     }
     // Select the longest dimension as division axis
-    for (i=0;i<3;i++) dim_range[i] = max_value[i] - min_value[i];
+    float dim_range[3] = {max_x - min_x, max_y - min_y, max_z - min_z};
     for (i=1;i<3;i++) if (dim_range[i] > dim_range[div_axis]) div_axis = i;
-    // Divide by the division axis and recursively build.
+    // Divide by the division axis
+    bool (*point_cmp)(PointType, PointType) = point_cmp_x;
+    if (div_axis == 1) point_cmp = point_cmp_y;
+    if (div_axis == 2) point_cmp = point_cmp_z;
+    #ifdef MP_EN
+    if (parallel){
+        // the parallel mode takes its thread count from the calling thread
+        int max_threads = omp_get_max_threads();
+        omp_set_num_threads(build_threads);
+        __gnu_parallel::nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp);
+        omp_set_num_threads(max_threads);
+        return div_axis;
+    }
+    #endif
+    nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp);
+    return div_axis;
+}
 
-    (*root)->division_axis = div_axis;
-    switch (div_axis)
-    {
-    case 0:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_x);
-        break;
-    case 1:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_y);
-        break;
-    case 2:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_z);
-        break;
-    default:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_x);
-        break;
-    }  
-    (*root)->point = Storage[mid]; 
-    KD_TREE_NODE * left_son = nullptr, * right_son = nullptr;
-    BuildTree(&left_son, l, mid-1, Storage);
-    BuildTree(&right_son, mid+1, r, Storage);  
-    (*root)->left_son_ptr = left_son;
-    (*root)->right_son_ptr = right_son;
-    Update((*root));  
-    return;
+/*
+  Same tree layout as BuildTree. The top levels are split one node at a time with a parallel bounding box and
+  a parallel nth_element, until there are a few independent subtrees per worker or they fall below
+  Parallel_Build_Point_Num. The subtrees are then built by the workers, each from its slice of one batch of
+  nodes taken from the pool up front, and the split nodes are updated bottom-up.
+*/
+void KD_TREE::BuildTree_Parallel(KD_TREE_NODE ** root, int l, int r, PointVector & Storage){
+    #ifdef MP_EN
+    if (build_threads > 1 && r - l + 1 >= Parallel_Build_Point_Num){
+        struct BuildRange{
+            KD_TREE_NODE ** root;
+            int l, r;
+        };
+        vector<BuildRange> level(1, BuildRange{root, l, r}), next_level, subtrees;
+        vector<KD_TREE_NODE *> split_nodes;
+        while (!level.empty()){
+            next_level.clear();
+            for (const BuildRange & range : level){
+                if (range.r - range.l + 1 < Parallel_Build_Point_Num || int(subtrees.size() + level.size() + next_level.size()) >= 4 * build_threads){
+                    subtrees.push_back(range);
+                    continue;
+                }
+                int mid = (range.l+range.r)>>1;
+                KD_TREE_NODE * node = node_pool.alloc();
+                InitTreeNode(node);
+                node->division_axis = Division_Axis(range.l, range.r, Storage, true);
+                node->point = Storage[mid];
+                *range.root = node;
+                split_nodes.push_back(node);
+                next_level.push_back(BuildRange{&node->left_son_ptr, range.l, mid-1});
+                next_level.push_back(BuildRange{&node->right_son_ptr, mid+1, range.r});
+            }
+            level.swap(next_level);
+        }
+        // All node batches are taken before the parallel region, a bad_alloc thrown inside it would terminate
+        vector<int> node_offset(subtrees.size() + 1, 0);
+        for (int i = 0; i < int(subtrees.size()); i++) node_offset[i+1] = node_offset[i] + max(subtrees[i].r - subtrees[i].l + 1, 0);
+        vector<KD_TREE_NODE *> nodes(node_offset.back());
+        node_pool.alloc(nodes.size(), nodes.data());
+        #pragma omp parallel for num_threads(build_threads) schedule(dynamic)
+        for (int i = 0; i < int(subtrees.size()); i++){
+            const BuildRange & range = subtrees[i];
+            BuildTree(range.root, range.l, range.r, Storage, nodes.data() + node_offset[i]);
+        }
+        for (int i = int(split_nodes.size()) - 1; i >= 0; i--) Update(split_nodes[i]);
+        return;
+    }
+    #endif
+    BuildTree(root, l, r, Storage);
 }
 
 void KD_TREE::Rebuild(KD_TREE_NODE ** root){    
@@ -593,6 +840,7 @@ void KD_TREE::Rebuild(KD_TREE_NODE ** root){
             pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
         }
     } else {
+        auto t_start = chrono::steady_clock::now();
         father_ptr = (*root)->father_ptr;
         int size_rec = (*root)->TreeSize;
         PCL_Storage.clear();
@@ -601,6 +849,11 @@ void KD_TREE::Rebuild(KD_TREE_NODE ** root){
         BuildTree(root, 0, PCL_Storage.size()-1, PCL_Storage);
         if (*root != nullptr) (*root)->father_ptr = father_ptr;
         if (*root == Root_Node) STATIC_ROOT_NODE->left_son_ptr = *root;
+        double rebuild_us = chrono::duration<double, micro>(chrono::steady_clock::now() - t_start).count();
+        pthread_mutex_lock(&stats_mutex_lock);
+        stats.rebuild.record(rebuild_us);
+        stats.rebuild_points += PCL_Storage.size();
+        pthread_mutex_unlock(&stats_mutex_lock);
     } 
     return;
 }
@@ -774,7 +1027,7 @@ void KD_TREE::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool all
 
 void KD_TREE::Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild, int father_axis){     
     if (*root == nullptr){
-        *root = new KD_TREE_NODE;
+        *root = node_pool.alloc();
         InitTreeNode(*root);
         (*root)->point = point;
         (*root)->division_axis = (father_axis + 1) % 3;
@@ -822,22 +1075,20 @@ void KD_TREE::Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_reb
     return;
 }
 
-void KD_TREE::Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist){
-    if (root == nullptr || root->tree_deleted) return;   
+/*
+  Read-only: pending push-downs are left to the writers. pushed holds the effective flags of the father when a
+  push-down to root is pending on it or on an ancestor, and node_flags applies it the way Push_Down would, so
+  a subtree un-deleted by Add_by_range is searched before its sons have been updated.
+*/
+void KD_TREE::Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist, int &visit_budget, const KD_TREE_FLAGS *pushed){
+    if (root == nullptr) return;
+    KD_TREE_FLAGS flags = node_flags(root, pushed);
+    if (flags.tree_deleted) return;
+    if (visit_budget <= 0 && q.size() >= k_nearest) return;
+    visit_budget--;
     double cur_dist = calc_box_dist(root, point);
     if (cur_dist > max_dist * max_dist) return;    
-    int retval; 
-    if (root->need_push_down_to_left || root->need_push_down_to_right) {
-        retval = pthread_mutex_trylock(&(root->push_down_mutex_lock));
-        if (retval == 0){
-            Push_Down(root);
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        } else {
-            pthread_mutex_lock(&(root->push_down_mutex_lock));
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
-    }
-    if (!root->point_deleted){
+    if (!flags.point_deleted){
         float dist = calc_dist(point, root->point);
         if (dist <= max_dist && (q.size() < k_nearest || dist < q.top().dist)){
             if (q.size() >= k_nearest) q.pop();
@@ -845,128 +1096,50 @@ void KD_TREE::Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL
             q.push(current_point);            
         }
     }  
-    int cur_search_counter;
-    float dist_left_node = calc_box_dist(root->left_son_ptr, point);
-    float dist_right_node = calc_box_dist(root->right_son_ptr, point);
+    // pairs with the release store that links a rebuilt subtree, see multi_thread_rebuild
+    KD_TREE_NODE * left_son_ptr = __atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE);
+    KD_TREE_NODE * right_son_ptr = __atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE);
+    const KD_TREE_FLAGS * left_pushed = (pushed != nullptr || root->need_push_down_to_left) ? &flags : nullptr;
+    const KD_TREE_FLAGS * right_pushed = (pushed != nullptr || root->need_push_down_to_right) ? &flags : nullptr;
+    float dist_left_node = calc_box_dist(left_son_ptr, point) * search_eps_scale;
+    float dist_right_node = calc_box_dist(right_son_ptr, point) * search_eps_scale;
     if (q.size()< k_nearest || dist_left_node < q.top().dist && dist_right_node < q.top().dist){
         if (dist_left_node <= dist_right_node) {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);                       
-            } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);  
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            Search(left_son_ptr, k_nearest, point, q, max_dist, visit_budget, left_pushed);                       
             if (q.size() < k_nearest || dist_right_node < q.top().dist) {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);                       
-                } else {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);                    
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);  
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }                
+                Search(right_son_ptr, k_nearest, point, q, max_dist, visit_budget, right_pushed);                       
             }
         } else {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);                       
-            } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);                   
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);  
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            Search(right_son_ptr, k_nearest, point, q, max_dist, visit_budget, right_pushed);                       
             if (q.size() < k_nearest || dist_left_node < q.top().dist) {            
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);                       
-                } else {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);  
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);  
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }
+                Search(left_son_ptr, k_nearest, point, q, max_dist, visit_budget, left_pushed);                       
             }
         }
     } else {
         if (dist_left_node < q.top().dist) {        
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);                       
-            } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);  
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);  
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            Search(left_son_ptr, k_nearest, point, q, max_dist, visit_budget, left_pushed);                       
         }
         if (dist_right_node < q.top().dist) {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);                       
-            } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);  
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            Search(right_son_ptr, k_nearest, point, q, max_dist, visit_budget, right_pushed);
         }
     }
     return;
 }
 
+/* All valid points within radius of point, read-only like Search */
+void KD_TREE::Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage, const KD_TREE_FLAGS *pushed){
+    if (root == nullptr) return;
+    KD_TREE_FLAGS flags = node_flags(root, pushed);
+    if (flags.tree_deleted) return;
+    if (calc_box_dist(root, point) > radius * radius) return;
+    if (!flags.point_deleted && calc_dist(root->point, point) <= radius * radius){
+        Storage.push_back(root->point);
+    }
+    Search_by_radius(__atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE), point, radius, Storage, (pushed != nullptr || root->need_push_down_to_left) ? &flags : nullptr);
+    Search_by_radius(__atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE), point, radius, Storage, (pushed != nullptr || root->need_push_down_to_right) ? &flags : nullptr);
+    return;
+}
+
 void KD_TREE::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector & Storage){
     if (root == nullptr) return;
     Push_Down(root);       
@@ -983,16 +1156,16 @@ void KD_TREE::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVe
     if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr){
         Search_by_range(root->left_son_ptr, boxpoint, Storage);
     } else {
-        pthread_mutex_lock(&search_flag_mutex);
+        pthread_mutex_lock(&working_flag_mutex);
         Search_by_range(root->left_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+        pthread_mutex_unlock(&working_flag_mutex);
     }
     if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr){
         Search_by_range(root->right_son_ptr, boxpoint, Storage);
     } else {
-        pthread_mutex_lock(&search_flag_mutex);
+        pthread_mutex_lock(&working_flag_mutex);
         Search_by_range(root->right_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+        pthread_mutex_unlock(&working_flag_mutex);
     }
     return;    
 }
@@ -1089,6 +1262,23 @@ void KD_TREE::Push_Down(KD_TREE_NODE *root){
     return;
 }
 
+/* Flags of root once the push-down pending from its father, whose effective flags are pushed, is applied */
+KD_TREE_FLAGS KD_TREE::node_flags(const KD_TREE_NODE *root, const KD_TREE_FLAGS *pushed){
+    KD_TREE_FLAGS flags;
+    flags.tree_downsample_deleted = root->tree_downsample_deleted;
+    flags.point_downsample_deleted = root->point_downsample_deleted;
+    if (pushed == nullptr){
+        flags.tree_deleted = root->tree_deleted;
+        flags.point_deleted = root->point_deleted;
+        return flags;
+    }
+    flags.tree_downsample_deleted |= pushed->tree_downsample_deleted;
+    flags.point_downsample_deleted |= pushed->tree_downsample_deleted;
+    flags.tree_deleted = pushed->tree_deleted || flags.tree_downsample_deleted;
+    flags.point_deleted = flags.tree_deleted || flags.point_downsample_deleted;
+    return flags;
+}
+
 void KD_TREE::Update(KD_TREE_NODE * root){
     KD_TREE_NODE * left_son_ptr = root->left_son_ptr;
     KD_TREE_NODE * right_son_ptr = root->right_son_ptr;
@@ -1227,24 +1417,33 @@ void KD_TREE::Update(KD_TREE_NODE * root){
 }
 
 void KD_TREE::flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type){
+    flatten(root, Storage, storage_type, nullptr);
+}
+
+/*
+  Read-only like Search, pending push-downs are applied through pushed. The rebuild thread flattens a subtree
+  that searches may be reading, so it must not write node flags; writers on the main thread push them down
+  themselves, and the discarded subtree is only pushed down by delete_tree_nodes once the searches drained.
+*/
+void KD_TREE::flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type, const KD_TREE_FLAGS *pushed){
     if (root == nullptr) return;
-    Push_Down(root);
-    if (!root->point_deleted) {
+    KD_TREE_FLAGS flags = node_flags(root, pushed);
+    if (!flags.point_deleted) {
         Storage.push_back(root->point);
     }
-    flatten(root->left_son_ptr, Storage, storage_type);
-    flatten(root->right_son_ptr, Storage, storage_type);
+    flatten(root->left_son_ptr, Storage, storage_type, (pushed != nullptr || root->need_push_down_to_left) ? &flags : nullptr);
+    flatten(root->right_son_ptr, Storage, storage_type, (pushed != nullptr || root->need_push_down_to_right) ? &flags : nullptr);
     switch (storage_type)
     {
     case NOT_RECORD:
         break;
     case DELETE_POINTS_REC:
-        if (root->point_deleted && !root->point_downsample_deleted) {
+        if (flags.point_deleted && !flags.point_downsample_deleted) {
             Points_deleted.push_back(root->point);
         }       
         break;
     case MULTI_THREAD_REC:
-        if (root->point_deleted  && !root->point_downsample_deleted) {
+        if (flags.point_deleted && !flags.point_downsample_deleted) {
             Multithread_Points_deleted.push_back(root->point);
         }
         break;
@@ -1260,7 +1459,7 @@ void KD_TREE::delete_tree_nodes(KD_TREE_NODE ** root){
     delete_tree_nodes(&(*root)->left_son_ptr);
     delete_tree_nodes(&(*root)->right_son_ptr);  
     pthread_mutex_destroy( &(*root)->push_down_mutex_lock);              
-    delete *root;
+    node_pool.free(*root);
     *root = nullptr;                    
 
     return;
@@ -1292,6 +1491,130 @@ bool KD_TREE::point_cmp_x(PointType a, PointType b) { return a.x < b.x;}
 bool KD_TREE::point_cmp_y(PointType a, PointType b) { return a.y < b.y;}
 bool KD_TREE::point_cmp_z(PointType a, PointType b) { return a.z < b.z;}
 
+// Latency histogram
+static int latency_bin(double us){
+    return us < 1.0 ? 0 : min(LATENCY_BINS - 1, ilogb(us) + 1);
+}
+
+void KD_TREE_LATENCY::record(double us){
+    bins[latency_bin(us)]++;
+    count++;
+    total_us += us;
+    max_us = max(max_us, us);
+}
+
+double KD_TREE_LATENCY::mean_us() const{
+    return count > 0 ? total_us / count : 0.0;
+}
+
+double KD_TREE_LATENCY::percentile_us(double p) const{
+    if (count == 0) return 0.0;
+    uint64_t target = max(uint64_t(1), uint64_t(ceil(p * count)));
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BINS - 1; i++){
+        seen += bins[i];
+        if (seen >= target) return min(ldexp(1.0, i), max_us);
+    }
+    return max_us;
+}
+
+KD_TREE_SEARCH_COUNTERS::KD_TREE_SEARCH_COUNTERS(){
+    for (int i = 0; i < LATENCY_BINS; i++) bins[i].store(0, memory_order_relaxed);
+}
+
+void KD_TREE_SEARCH_COUNTERS::record(double us, uint64_t query_num, uint64_t visited){
+    uint64_t ns = uint64_t(us * 1000.0);
+    bins[latency_bin(us)].fetch_add(1, memory_order_relaxed);
+    count.fetch_add(1, memory_order_relaxed);
+    total_ns.fetch_add(ns, memory_order_relaxed);
+    queries.fetch_add(query_num, memory_order_relaxed);
+    if (visited > 0) nodes_visited.fetch_add(visited, memory_order_relaxed);
+    uint64_t old_max = max_ns.load(memory_order_relaxed);
+    while (ns > old_max && !max_ns.compare_exchange_weak(old_max, ns, memory_order_relaxed));
+}
+
+void KD_TREE_SEARCH_COUNTERS::read(KD_TREE_STATS &stats) const{
+    for (int i = 0; i < LATENCY_BINS; i++) stats.search.bins[i] = bins[i].load(memory_order_relaxed);
+    stats.search.count = count.load(memory_order_relaxed);
+    stats.search.total_us = total_ns.load(memory_order_relaxed) / 1000.0;
+    stats.search.max_us = max_ns.load(memory_order_relaxed) / 1000.0;
+    stats.search_queries = queries.load(memory_order_relaxed);
+    stats.search_nodes_visited = nodes_visited.load(memory_order_relaxed);
+}
+
+void KD_TREE_SEARCH_COUNTERS::clear(){
+    for (int i = 0; i < LATENCY_BINS; i++) bins[i].store(0, memory_order_relaxed);
+    count.store(0, memory_order_relaxed);
+    total_ns.store(0, memory_order_relaxed);
+    max_ns.store(0, memory_order_relaxed);
+    queries.store(0, memory_order_relaxed);
+    nodes_visited.store(0, memory_order_relaxed);
+}
+
+// Tree node pool
+KD_TREE_NODE_POOL::KD_TREE_NODE_POOL(){
+    pthread_mutex_init(&pool_mutex_lock, NULL);
+}
+
+KD_TREE_NODE_POOL::~KD_TREE_NODE_POOL(){
+    for (KD_TREE_NODE * slab : slabs) ::free(slab);
+    pthread_mutex_destroy(&pool_mutex_lock);
+}
+
+KD_TREE_NODE * KD_TREE_NODE_POOL::alloc(){
+    KD_TREE_NODE * node;
+    alloc(1, &node);
+    return node;
+}
+
+void KD_TREE_NODE_POOL::alloc(int n, KD_TREE_NODE ** nodes){
+    pthread_mutex_lock(&pool_mutex_lock);
+    for (int i = 0; i < n; i++){
+        if (free_list != nullptr){
+            nodes[i] = free_list;
+            free_list = free_list->left_son_ptr;
+            free_num--;
+            continue;
+        }
+        if (slab_used == NODE_POOL_SLAB_SIZE){
+            void * slab = nullptr;
+            if (posix_memalign(&slab, alignof(KD_TREE_NODE), sizeof(KD_TREE_NODE) * NODE_POOL_SLAB_SIZE) != 0){
+                // hand the nodes taken so far back before failing
+                for (int j = 0; j < i; j++){
+                    nodes[j]->left_son_ptr = free_list;
+                    free_list = nodes[j];
+                }
+                free_num += i;
+                pthread_mutex_unlock(&pool_mutex_lock);
+                throw std::bad_alloc();
+            }
+            slabs.push_back((KD_TREE_NODE *) slab);
+            slab_used = 0;
+        }
+        nodes[i] = slabs.back() + slab_used;
+        slab_used++;
+    }
+    pthread_mutex_unlock(&pool_mutex_lock);
+    for (int i = 0; i < n; i++) new (nodes[i]) KD_TREE_NODE;
+}
+
+void KD_TREE_NODE_POOL::free(KD_TREE_NODE * node){
+    pthread_mutex_lock(&pool_mutex_lock);
+    // a freed node is only a free list link, its other fields are reset by the next alloc
+    node->left_son_ptr = free_list;
+    free_list = node;
+    free_num++;
+    pthread_mutex_unlock(&pool_mutex_lock);
+}
+
+/* Bytes held in slabs, and the nodes of them that are free or not carved yet */
+void KD_TREE_NODE_POOL::usage(size_t & bytes, int & free_nodes){
+    pthread_mutex_lock(&pool_mutex_lock);
+    bytes = slabs.size() * NODE_POOL_SLAB_SIZE * sizeof(KD_TREE_NODE);
+    free_nodes = free_num + (slabs.empty() ? 0 : NODE_POOL_SLAB_SIZE - slab_used);
+    pthread_mutex_unlock(&pool_mutex_lock);
+}
+
 // Manual heap
 MANUAL_HEAP::MANUAL_HEAP(int max_capacity){
     cap = max_capacity;
@@ -1362,45 +1685,77 @@ void MANUAL_HEAP::FloatUp(int heap_index){
 }
 
 // manual queue
+MANUAL_Q::~MANUAL_Q(){
+    for (Operation_Logger_Type * chunk : chunks) delete[] chunk;
+    for (Operation_Logger_Type * chunk : spare_chunks) delete[] chunk;
+}
+
+void MANUAL_Q::release_chunk(Operation_Logger_Type * chunk){
+    if (spare_chunks.size() < Q_SPARE_CHUNKS) spare_chunks.push_back(chunk);
+    else delete[] chunk;
+}
+
 void MANUAL_Q::clear(){
+    for (Operation_Logger_Type * chunk : chunks) release_chunk(chunk);
+    chunks.clear();
     head = 0;
     tail = 0;
     counter = 0;
-    is_empty = true;
     return;
 }
 
 void MANUAL_Q::pop(){
     if (counter == 0) return;
     head ++;
-    head %= Q_LEN;
     counter --;
-    if (counter == 0) is_empty = true;
+    if (counter == 0){
+        clear();
+    } else if (head == Q_CHUNK_LEN){
+        release_chunk(chunks.front());
+        chunks.erase(chunks.begin());
+        head = 0;
+    }
     return;
 }
 
 Operation_Logger_Type MANUAL_Q::front(){
-    return q[head];
+    return chunks.front()[head];
 }
 
 Operation_Logger_Type MANUAL_Q::back(){
-    return q[tail];
+    return chunks.back()[tail - 1];
 }
 
 void MANUAL_Q::push(Operation_Logger_Type op){
-    q[tail] = op;
-    counter ++;
-    if (is_empty) is_empty = false;
+    if (chunks.empty() || tail == Q_CHUNK_LEN){
+        if (!spare_chunks.empty()){
+            chunks.push_back(spare_chunks.back());
+            spare_chunks.pop_back();
+        } else {
+            chunks.push_back(new Operation_Logger_Type[Q_CHUNK_LEN]);
+        }
+        tail = 0;
+    }
+    chunks.back()[tail] = op;
     tail ++;
-    tail %= Q_LEN;
+    counter ++;
+    max_counter = max(max_counter, counter);
 }
 
 bool MANUAL_Q::empty(){
-    return is_empty;
+    return counter == 0;
 }
 
 int MANUAL_Q::size(){
     return counter;
 }
 
+int MANUAL_Q::high_water(){
+    return max_counter;
+}
+
+size_t MANUAL_Q::bytes(){
+    return (chunks.size() + spare_chunks.size()) * Q_CHUNK_LEN * sizeof(Operation_Logger_Type);
+}
+
 
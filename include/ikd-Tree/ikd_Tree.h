@@ -3,8 +3,10 @@
 #include <Eigen/StdVector>
 #include <Eigen/Geometry>
 #include <stdio.h>
+#include <stdint.h>
 #include <queue>
 #include <pthread.h>
+#include <atomic>
 #include <chrono>
 #include <time.h>
 
@@ -12,9 +14,13 @@
 #define EPSS 1e-6
 #define Minimal_Unbalanced_Tree_Size 10
 #define Multi_Thread_Rebuild_Point_Num 1500
+#define Parallel_Build_Point_Num 65536
 #define DOWNSAMPLE_SWITCH true
 #define ForceRebuildPercentage 0.2
-#define Q_LEN 1000000
+#define Q_CHUNK_LEN 1024
+#define Q_SPARE_CHUNKS 4
+#define NODE_POOL_SLAB_SIZE 4096
+#define LATENCY_BINS 24
 
 using namespace std;
 
@@ -23,28 +29,42 @@ typedef vector<PointType, Eigen::aligned_allocator<PointType>>  PointVector;
 
 const PointType ZeroP;
 
-struct KD_TREE_NODE
+/*
+  Fields are ordered hot to cold: the first cache line holds everything Search reads from a node to decide
+  whether to descend into it (box, flags, sons), followed by the point itself. Bookkeeping for updates,
+  rebuilds and the push-down lock comes last.
+*/
+struct alignas(64) KD_TREE_NODE
 {
-    PointType point;
-    int division_axis;  
-    int TreeSize = 1;
-    int invalid_point_num = 0;
-    int down_del_num = 0;
+    float node_range_x[2], node_range_y[2], node_range_z[2];   
     bool point_deleted = false;
     bool tree_deleted = false; 
-    bool point_downsample_deleted = false;
-    bool tree_downsample_deleted = false;
     bool need_push_down_to_left = false;
     bool need_push_down_to_right = false;
-    bool working_flag = false;
-    pthread_mutex_t push_down_mutex_lock;
-    float node_range_x[2], node_range_y[2], node_range_z[2];   
+    bool point_downsample_deleted = false;
+    bool tree_downsample_deleted = false;
     KD_TREE_NODE *left_son_ptr = nullptr;
     KD_TREE_NODE *right_son_ptr = nullptr;
+    PointType point;
     KD_TREE_NODE *father_ptr = nullptr;
+    int division_axis;  
+    int TreeSize = 1;
+    int invalid_point_num = 0;
+    int down_del_num = 0;
+    bool working_flag = false;
     // For paper data record
     float alpha_del;
     float alpha_bal;
+    pthread_mutex_t push_down_mutex_lock;
+};
+
+/*
+  Deleted flags of a node as a read-only traversal sees them. Writers push the flags of a node down to its
+  sons lazily; a traversal passing a pending push-down applies it to this copy instead of the sons.
+*/
+struct KD_TREE_FLAGS{
+    bool tree_deleted, point_deleted;
+    bool tree_downsample_deleted, point_downsample_deleted;
 };
 
 struct PointType_CMP{
@@ -76,12 +96,62 @@ struct Operation_Logger_Type{
     operation_set op;
 };
 
+/*
+  Call latencies in power-of-two microsecond bins: bin 0 counts calls under 1 us, bin i those of
+  [2^(i-1), 2^i) us and the last bin everything longer.
+*/
+struct KD_TREE_LATENCY{
+    uint64_t count = 0;
+    double total_us = 0.0, max_us = 0.0;
+    uint64_t bins[LATENCY_BINS] = {};
+    void record(double us);
+    double mean_us() const;
+    double percentile_us(double p) const;   // upper edge of the bin holding the p-th percentile, p in [0, 1]
+};
+
+/*
+  Snapshot returned by KD_TREE::get_stats(). Latencies and counters accumulate until reset_stats(), search
+  latencies are per Nearest_Search or Nearest_Search_Batch call. Nodes still in the tree but deleted,
+  tree_size - valid_num, are only freed by the next rebuild of their subtree.
+*/
+struct KD_TREE_STATS{
+    KD_TREE_LATENCY add_points, delete_boxes, search, rebuild, thread_rebuild;
+    uint64_t search_queries = 0, search_nodes_visited = 0;
+    uint64_t rebuild_points = 0, thread_rebuild_points = 0;
+    int tree_size = 0, valid_num = 0;
+    int pending_ops = 0, pending_ops_high_water = 0;   // rebuild operation log
+    int free_nodes = 0;                                 // in the node pool, ready for reuse
+    size_t node_pool_bytes = 0, log_bytes = 0;
+};
+
+/*
+  Search side of KD_TREE_STATS. Searches run concurrently and without locks, so they count with relaxed atomics
+  instead of taking the stats lock, and get_stats() folds the counters into its snapshot.
+*/
+struct KD_TREE_SEARCH_COUNTERS{
+    atomic<uint64_t> count{0}, total_ns{0}, max_ns{0}, queries{0}, nodes_visited{0};
+    atomic<uint64_t> bins[LATENCY_BINS];
+    KD_TREE_SEARCH_COUNTERS();
+    void record(double us, uint64_t query_num, uint64_t visited);
+    void read(KD_TREE_STATS &stats) const;
+    void clear();
+};
+
+/*
+  Operation log of the rebuild thread. Entries live in chunks of Q_CHUNK_LEN that are allocated when the log
+  grows and recycled when it drains, keeping up to Q_SPARE_CHUNKS spare, so an idle log holds almost no memory
+  and a long rebuild can never overrun it. Callers serialize access with rebuild_logger_mutex_lock.
+*/
 class MANUAL_Q{
     private:
-        int head = 0,tail = 0, counter = 0;
-        Operation_Logger_Type q[Q_LEN];
-        bool is_empty;
+        int head = 0,tail = 0, counter = 0, max_counter = 0;
+        vector<Operation_Logger_Type *> chunks, spare_chunks;
+        void release_chunk(Operation_Logger_Type * chunk);
     public:
+        MANUAL_Q() = default;
+        MANUAL_Q(const MANUAL_Q &) = delete;
+        MANUAL_Q & operator=(const MANUAL_Q &) = delete;
+        ~MANUAL_Q();
         void pop();
         Operation_Logger_Type front();
         Operation_Logger_Type back();
@@ -89,6 +159,31 @@ class MANUAL_Q{
         void push(Operation_Logger_Type op);
         bool empty();
         int size();
+        int high_water();
+        size_t bytes();
+};
+
+/*
+  Slab allocator for tree nodes. Nodes are carved from 64-byte aligned slabs of NODE_POOL_SLAB_SIZE and freed
+  nodes go to a free list, so a rebuilt subtree reuses the nodes of the one it replaces. Slabs are released
+  with the pool. Shared by the main and the rebuild thread, alloc(n, nodes) takes a whole batch under one lock
+  for the workers of a parallel build.
+*/
+class KD_TREE_NODE_POOL
+{
+    public:
+        KD_TREE_NODE_POOL();
+        ~KD_TREE_NODE_POOL();
+        KD_TREE_NODE * alloc();
+        void alloc(int n, KD_TREE_NODE ** nodes);
+        void free(KD_TREE_NODE * node);
+        void usage(size_t & bytes, int & free_nodes);
+    private:
+        pthread_mutex_t pool_mutex_lock;
+        vector<KD_TREE_NODE *> slabs;
+        KD_TREE_NODE * free_list = nullptr;
+        int slab_used = NODE_POOL_SLAB_SIZE;
+        int free_num = 0;
 };
 
 class MANUAL_HEAP
@@ -117,17 +212,28 @@ private:
     bool termination_flag = false;
     bool rebuild_flag = false;
     pthread_t rebuild_thread;
-    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex, search_flag_mutex;
+    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex;
     pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock;
+    // Statistics, written once per public call and by the rebuild thread, searches only touch search_counters
+    pthread_mutex_t stats_mutex_lock;
+    KD_TREE_STATS stats;
+    KD_TREE_SEARCH_COUNTERS search_counters;
+    void record_stats(KD_TREE_LATENCY KD_TREE_STATS::* op, chrono::steady_clock::time_point start, bool update_size);
     // queue<Operation_Logger_Type> Rebuild_Logger;
     MANUAL_Q Rebuild_Logger;    
     PointVector Rebuild_PCL_Storage;
     KD_TREE_NODE ** Rebuild_Ptr = nullptr;
-    int search_mutex_counter = 0;
+    KD_TREE_NODE_POOL node_pool;
+    // Reader side of the subtree reclamation, see enter_search_epoch()
+    std::atomic<unsigned> search_epoch{0};
+    std::atomic<int> search_readers[2] = {{0}, {0}};
     static void * multi_thread_ptr(void *arg);
     void multi_thread_rebuild();
     void start_thread();
     void stop_thread();
+    int enter_search_epoch();
+    void exit_search_epoch(int slot);
+    void wait_for_search_epoch();
     void run_operation(KD_TREE_NODE ** root, Operation_Logger_Type operation);
     // KD Tree Functions and augmented variables
     int Treesize_tmp = 0, Validnum_tmp = 0;
@@ -135,6 +241,9 @@ private:
     float delete_criterion_param = 0.5f;
     float balance_criterion_param = 0.7f;
     float downsample_size = 0.2f;
+    int build_threads = 1;
+    float search_eps_scale = 1.0f;
+    int search_max_visits = -1;
     bool Delete_Storage_Disabled = false;
     KD_TREE_NODE * STATIC_ROOT_NODE = nullptr;
     PointVector Points_deleted;
@@ -142,16 +251,21 @@ private:
     PointVector Multithread_Points_deleted;
     void InitTreeNode(KD_TREE_NODE * root);
     void Test_Lock_States(KD_TREE_NODE *root);
-    void BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage);
+    void BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage, KD_TREE_NODE ** nodes = nullptr);
+    void BuildTree_Parallel(KD_TREE_NODE ** root, int l, int r, PointVector & Storage);
+    int Division_Axis(int l, int r, PointVector & Storage, bool parallel);
     void Rebuild(KD_TREE_NODE ** root);
     int Delete_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample);
     void Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild);
     void Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild, int father_axis);
     void Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild);
-    void Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist);//priority_queue<PointType_CMP>
+    void Search(KD_TREE_NODE * root, int k_nearest, PointType point, MANUAL_HEAP &q, double max_dist, int &visit_budget, const KD_TREE_FLAGS *pushed);//priority_queue<PointType_CMP>
+    void Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage, const KD_TREE_FLAGS *pushed);
     void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage);
     bool Criterion_Check(KD_TREE_NODE * root);
     void Push_Down(KD_TREE_NODE * root);
+    static KD_TREE_FLAGS node_flags(const KD_TREE_NODE *root, const KD_TREE_FLAGS *pushed);
+    void flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type, const KD_TREE_FLAGS *pushed);
     void Update(KD_TREE_NODE * root); 
     void delete_tree_nodes(KD_TREE_NODE ** root);
     void downsample(KD_TREE_NODE ** root);
@@ -168,12 +282,16 @@ public:
     void Set_delete_criterion_param(float delete_param);
     void Set_balance_criterion_param(float balance_param);
     void set_downsample_param(float box_length);
+    void set_build_threads(int threads);
+    void set_approximate_search(float epsilon, int max_visits);
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2); 
     int size();
     int validnum();
     void root_alpha(float &alpha_bal, float &alpha_del);
     void Build(PointVector point_cloud);
     void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance, double max_dist = INFINITY);
+    void Nearest_Search_Batch(const PointVector &points, int k_nearest, vector<PointVector> &Nearest_Points, vector<vector<float>> &Point_Distance, double max_dist = INFINITY);
+    void Radius_Search(PointType point, const float radius, PointVector &Storage);
     int Add_Points(PointVector & PointToAdd, bool downsample_on);
     void Add_Point_Boxes(vector<BoxPointType> & BoxPoints);
     void Delete_Points(PointVector & PointToDel);
@@ -181,7 +299,9 @@ public:
     void flatten(KD_TREE_NODE * root, PointVector &Storage, delete_point_storage_set storage_type);
     void acquire_removed_points(PointVector & removed_points);
     BoxPointType tree_range();
+    KD_TREE_STATS get_stats();
+    void reset_stats();
     PointVector PCL_Storage;     
     KD_TREE_NODE * Root_Node = nullptr;
-    int max_queue_size = 0;
+    int max_queue_size = 0;    // high-water mark of the rebuild operation log
 };
@@ -26,13 +26,12 @@
 #include <lidar_imu_init/msg/states.hpp> 
 #include <rclcpp/rclcpp.hpp>
 #include <rclcpp/logging.hpp>
+#include "offset_time_sort.h"
 
 /// *************Preconfiguration
 
 #define MAX_INI_COUNT (200)
 
-const bool time_list(PointType &x, PointType &y) {return (x.curvature < y.curvature);};
-
 /// *************IMU Process and undistortion
 class ImuProcess
 {
@@ -87,6 +86,7 @@ class ImuProcess
   int    init_iter_num = 1;
   bool   b_first_frame_ = true;
   bool   imu_need_init_ = true;
+  OffsetTimeSorter time_sorter;
 };
 
 ImuProcess::ImuProcess()
@@ -203,10 +203,9 @@ void ImuProcess::IMU_init(const MeasureGroup &meas, StatesGroup &state_inout, in
 
 void ImuProcess::Forward_propagation_without_imu(const MeasureGroup &meas, StatesGroup &state_inout,
                              PointCloudXYZI &pcl_out) {
-    pcl_out = *(meas.lidar);
     /*** sort point clouds by offset time ***/
     const double &pcl_beg_time = meas.lidar_beg_time;
-    std::sort(pcl_out.points.begin(), pcl_out.points.end(), time_list);
+    time_sorter.sort(*(meas.lidar), pcl_out);
     const double &pcl_end_offset_time = pcl_out.points.back().curvature / double(1000);
 
     MD(DIM_STATE, DIM_STATE) F_x, cov_w;
@@ -269,7 +268,6 @@ void ImuProcess::Forward_propagation_without_imu(const MeasureGroup &meas, State
 void ImuProcess::propagation_and_undist(const MeasureGroup &meas, StatesGroup &state_inout, PointCloudXYZI &pcl_out)
 {
   /*** add the imu of the last frame-tail to the current frame-head ***/
-  pcl_out = *(meas.lidar);
   auto v_imu = meas.imu;
   // v_imu.push_front(last_imu_);
   v_imu.push_front(std::const_pointer_cast<sensor_msgs::msg::Imu>(last_imu_));
@@ -279,6 +277,7 @@ void ImuProcess::propagation_and_undist(const MeasureGroup &meas, StatesGroup &s
 
   if (lidar_type == L515)
   {
+    pcl_out = *(meas.lidar);
     pcl_beg_time = last_lidar_end_time_;
     pcl_end_time = meas.lidar_beg_time;
   }
@@ -286,7 +285,7 @@ void ImuProcess::propagation_and_undist(const MeasureGroup &meas, StatesGroup &s
   {
     pcl_beg_time = meas.lidar_beg_time;
     /*** sort point clouds by offset time ***/
-    sort(pcl_out.points.begin(), pcl_out.points.end(), time_list);
+    time_sorter.sort(*(meas.lidar), pcl_out);
     pcl_end_time = pcl_beg_time + pcl_out.points.back().curvature / double(1000);
   }
 
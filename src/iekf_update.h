@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Eigen/Dense>
+
+/*
+ * IEKF update in information form for a measurement Jacobian H = [Hsub 0], where Hsub only observes the first
+ * M of the N states. Of (H^T R^-1 H + P^-1)^-1 only the first M columns are then needed,
+ *
+ *   (H^T R^-1 H + P^-1)^-1 E = P E (I + H_T_H P_11)^-1 = P E P_11^-1 (P_11^-1 + H_T_H)^-1
+ *
+ * with H_T_H = Hsub^T R^-1 Hsub, so the gain is K = K_x Hsub^T R^-1 with K_x = P E P_11^-1 (P_11^-1 + H_T_H)^-1.
+ * The prior P stays fixed over the iterations of a scan, so P_11 is factored once at construction and each
+ * iteration costs a single MxM LDLT solve instead of two NxN inversions.
+ */
+template<int N, int M>
+class IekfInfoUpdate
+{
+  public:
+    typedef Eigen::Matrix<double, N, N> MatNN;
+    typedef Eigen::Matrix<double, N, M> MatNM;
+    typedef Eigen::Matrix<double, M, M> MatMM;
+    typedef Eigen::Matrix<double, N, 1> VecN;
+    typedef Eigen::Matrix<double, M, 1> VecM;
+
+    explicit IekfInfoUpdate(const MatNN &P) {
+        Eigen::LDLT<MatMM> P_11_ldlt(P.template block<M, M>(0, 0));
+        P_11_inv = P_11_ldlt.solve(MatMM::Identity());
+        P_E_P_11_inv = P_11_ldlt.solve(P.template block<M, N>(0, 0)).transpose();
+    }
+
+    /* K_x of one iteration */
+    MatNM gain(const MatMM &H_T_H) const {
+        return (P_11_inv + H_T_H).ldlt().solve(P_E_P_11_inv.transpose()).transpose();
+    }
+
+    /* State increment K z + dx - K H dx, with H_T_R_inv_z = Hsub^T R^-1 z and dx = prior state - current state */
+    static VecN increment(const MatNM &K_x, const MatMM &H_T_H, const VecM &H_T_R_inv_z, const VecN &dx) {
+        return K_x * (H_T_R_inv_z - H_T_H * dx.template head<M>()) + dx;
+    }
+
+    /* Updated covariance (I - K H) P, K H = [K_x H_T_H 0] */
+    static MatNN covariance(const MatNM &K_x, const MatMM &H_T_H, const MatNN &P) {
+        return P - (K_x * H_T_H) * P.template topRows<M>();
+    }
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  private:
+    MatMM P_11_inv;
+    MatNM P_E_P_11_inv;
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <thread>
+#include "lio_estimator.h"
+#include <nav_msgs/msg/odometry.hpp>
+#include <nav_msgs/msg/path.hpp>
+#include <geometry_msgs/msg/pose_stamped.hpp>
+#include <tf2_ros/transform_broadcaster.h>
+#include <diagnostic_msgs/msg/diagnostic_array.hpp>
+#include "pcd_writer.h"
+
+/* Immutable copy of what the publishers need from one scan */
+struct PublishSnapshot
+{
+    StatesGroup state;
+    geometry_msgs::msg::Quaternion geoQuat;
+    bool imu_en;
+    double lidar_end_time;
+    PointCloudXYZI::ConstPtr feats_undistort, feats_down_body, effect_body;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/*
+ * ROS wrapper of LioEstimator, also registered as the "LaserMapping" component. Subscriptions are served by
+ * the executor, the estimator runs on its own thread. Its state callback publishes odometry and TF right
+ * away, appends the pose to the path and hands a PublishSnapshot to the publish thread, which transforms,
+ * serializes and publishes the clouds and the path. When that thread falls behind, the oldest pending snapshot
+ * is dropped, its clouds are not published but its pose stays in the path. Offline replay never drops.
+ */
+class LaserMapping : public rclcpp::Node
+{
+  public:
+    explicit LaserMapping(const rclcpp::NodeOptions &options = rclcpp::NodeOptions(), bool subscribe = true);
+    ~LaserMapping();
+
+    void run_offline_bag(const string &bag_path);
+
+  private:
+    void init_parameters();
+    void standard_pcl_cbk(sensor_msgs::msg::PointCloud2::UniquePtr msg);
+#ifdef USE_LIVOX
+    void livox_pcl_cbk(livox_ros_driver2::msg::CustomMsg::UniquePtr msg);
+#endif
+    void imu_cbk(sensor_msgs::msg::Imu::UniquePtr msg);
+    void estimator_loop();
+    void publish_loop();
+    void publish_all();
+
+    void publish_frame_world(const PublishSnapshot &snap);
+    void publish_frame_body(const PublishSnapshot &snap);
+    void publish_effect_world(const PublishSnapshot &snap);
+    void publish_map();
+    void publish_odometry(const PublishSnapshot &snap);
+    void update_path(const PublishSnapshot &snap);
+    void publish_path();
+    void publish_map_stats();
+    template<typename T>
+    void set_posestamp(const PublishSnapshot &snap, T &out);
+
+    shared_ptr<LioEstimator> estimator;
+    MeasureGroup Measures;
+    std::thread estimator_thread, publish_thread;
+    BoundedQueue<shared_ptr<const PublishSnapshot>> publish_queue;
+
+    string root_dir = ROOT_DIR;
+    string map_file_path, lid_topic, imu_topic;
+    bool scan_pub_en = false, dense_pub_en = false, scan_body_pub_en = false;
+    bool runtime_pos_log = false, pcd_save_en = false, path_en = true;
+    bool map_load_en = false, map_save_en = false;
+    int pcd_save_interval = -1, path_count = 0;
+    double pcd_voxel_size = 0.0, pcd_max_buffer_mb = 512.0;
+    double map_stats_interval = 1.0;
+    std::unique_ptr<PcdStreamWriter> pcd_stream_writer;
+
+    mutex path_mutex;   // path is appended by the estimator thread and published by the publish thread
+    nav_msgs::msg::Path path;
+    bool path_updated = false;
+    nav_msgs::msg::Odometry odomAftMapped;
+    geometry_msgs::msg::PoseStamped msg_body_pose;
+
+#ifdef USE_LIVOX
+    rclcpp::Subscription<livox_ros_driver2::msg::CustomMsg>::SharedPtr sub_pcl_livox_;
+#endif
+    rclcpp::Subscription<sensor_msgs::msg::PointCloud2>::SharedPtr sub_pcl_pc_;
+    rclcpp::Subscription<sensor_msgs::msg::Imu>::SharedPtr sub_imu;
+    rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr pubLaserCloudFullRes;
+    rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr pubLaserCloudFullRes_body;
+    rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr pubLaserCloudEffect;
+    rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr pubLaserCloudMap;
+    rclcpp::Publisher<nav_msgs::msg::Odometry>::SharedPtr pubOdomAftMapped;
+    rclcpp::Publisher<nav_msgs::msg::Path>::SharedPtr pubPath;
+    rclcpp::Publisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr pubDiagnostics;
+    rclcpp::TimerBase::SharedPtr map_stats_timer;
+    std::unique_ptr<tf2_ros::TransformBroadcaster> tf_broadcaster;
+};
@@ -0,0 +1,25 @@
+#include "laserMapping.h"
+
+int main(int argc, char **argv) {
+    rclcpp::init(argc, argv);
+
+    // "--bag <path>" replays a rosbag2 file offline instead of subscribing to the topics
+    string bag_path;
+    vector<string> non_ros_args = rclcpp::remove_ros_arguments(argc, argv);
+    for (size_t i = 1; i + 1 < non_ros_args.size(); i++) {
+        if (non_ros_args[i] == "--bag") bag_path = non_ros_args[i + 1];
+    }
+
+    rclcpp::NodeOptions options;
+    options.use_intra_process_comms(true);
+    auto node = std::make_shared<LaserMapping>(options, bag_path.empty());
+
+    if (!bag_path.empty())
+        node->run_offline_bag(bag_path);
+    else
+        rclcpp::spin(node);
+
+    node.reset(); // joins the estimator thread and flushes the PCD before the context goes away
+    rclcpp::shutdown();
+    return 0;
+}
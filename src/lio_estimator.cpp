@@ -0,0 +1,983 @@
+#include <omp.h>
+#include "IMU_Processing.hpp"
+#include "lio_estimator.h"
+#include "iekf_update.h"
+#include <ament_index_cpp/get_package_share_directory.hpp>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.hpp>
+#include <boost/filesystem.hpp>
+
+const float MOV_THRESHOLD = 1.5f;
+
+float calc_dist(PointType p1, PointType p2) {
+    float d = (p1.x - p2.x) * (p1.x - p2.x) + (p1.y - p2.y) * (p1.y - p2.y) + (p1.z - p2.z) * (p1.z - p2.z);
+    return d;
+}
+
+void calcBodyVar(Eigen::Vector3d &pb, const float range_inc,
+                 const float degree_inc, Eigen::Matrix3d &var) {
+    float range = sqrt(pb[0] * pb[0] + pb[1] * pb[1] + pb[2] * pb[2]);
+    float range_var = range_inc * range_inc;
+    Eigen::Matrix2d direction_var;
+    direction_var << pow(sin(DEG2RAD(degree_inc)), 2), 0, 0,
+            pow(sin(DEG2RAD(degree_inc)), 2);
+    Eigen::Vector3d direction(pb);
+    direction.normalize();
+    Eigen::Matrix3d direction_hat;
+    direction_hat << 0, -direction(2), direction(1), direction(2), 0,
+            -direction(0), -direction(1), direction(0), 0;
+    Eigen::Vector3d base_vector1(1, 1,
+                                 -(direction(0) + direction(1)) / direction(2));
+    base_vector1.normalize();
+    Eigen::Vector3d base_vector2 = base_vector1.cross(direction);
+    base_vector2.normalize();
+    Eigen::Matrix<double, 3, 2> N;
+    N << base_vector1(0), base_vector2(0), base_vector1(1), base_vector2(1),
+            base_vector1(2), base_vector2(2);
+    Eigen::Matrix<double, 3, 2> A = range * direction_hat * N;
+    var = direction * range_var * direction.transpose() +
+          A * direction_var * A.transpose();
+}
+
+void printProgress(double percentage) {
+    int val = (int) (percentage * 100);
+    int lpad = (int) (percentage * PBWIDTH);
+    int rpad = PBWIDTH - lpad;
+    printf("\033[1A\r");
+    printf(BOLDMAGENTA "[Refinement] ");
+    if (percentage < 1) {
+        printf(BOLDYELLOW "Online Refinement: ");
+        printf(YELLOW "%3d%% [%.*s%*s]\n", val, lpad, PBSTR, rpad, "");
+        cout << RESET;
+    } else {
+        printf(BOLDGREEN " Online Refinement ");
+        printf(GREEN "%3d%% [%.*s%*s]\n", val, lpad, PBSTR, rpad, "");
+        cout << RESET;
+    }
+    fflush(stdout);
+}
+
+LioEstimator::LioEstimator()
+{
+    p_pre.reset(new Preprocess());
+    p_imu.reset(new ImuProcess());
+    Init_LI.reset(new LI_Init());
+
+    feats_undistort.reset(new PointCloudXYZI());
+    feats_down_body.reset(new PointCloudXYZI());
+    feats_down_world.reset(new PointCloudXYZI());
+    map_feats_body.reset(new PointCloudXYZI());
+    map_feats_world.reset(new PointCloudXYZI());
+    featsFromMap.reset(new PointCloudXYZI());
+    laserCloudOri.reset(new PointCloudXYZI());
+    _featsArray.reset(new PointCloudXYZI());
+
+
+    // LI Init Related
+    Jaco_rot.resize(30000, 3);
+    Jaco_rot.setZero();
+}
+
+LioEstimator::~LioEstimator()
+{
+    stop();
+    wait_map_update();
+    map_queue.close();
+    if (map_update_thread.joinable()) map_update_thread.join();
+}
+
+void LioEstimator::init()
+{
+    downSizeFilterSurf.setLeafSize(filter_size_surf_min, filter_size_surf_min, filter_size_surf_min);
+    downSizeFilterMap.setLeafSize(filter_size_map_min, filter_size_map_min, filter_size_map_min);
+    local_map = create_local_map(map_backend, filter_size_map_min, ikdtree_build_threads, bucket_leaf_size,
+                                 ivox_resolution, ivox_nearby_type, ivox_capacity);
+    local_map->set_approximate_search(knn_epsilon, knn_max_visits);
+    local_map->set_rebuild_criteria(ikdtree_delete_param, ikdtree_balance_param);
+
+    p_imu->lidar_type = p_pre->lidar_type = lidar_type;
+    p_imu->imu_en = imu_en;
+    p_imu->LI_init_done = false;
+    p_imu->set_gyr_cov(V3D(gyr_cov, gyr_cov, gyr_cov));
+    p_imu->set_acc_cov(V3D(acc_cov, acc_cov, acc_cov));
+    p_imu->set_R_LI_cov(V3D(VEC_FROM_ARRAY(Rot_LI_cov)));
+    p_imu->set_T_LI_cov(V3D(VEC_FROM_ARRAY(Trans_LI_cov)));
+    p_imu->set_gyr_bias_cov(V3D(b_gyr_cov, b_gyr_cov, b_gyr_cov));
+    p_imu->set_acc_bias_cov(V3D(b_acc_cov, b_acc_cov, b_acc_cov));
+
+    decode_queue.set_capacity(decode_queue_len);
+    decode_thread = std::thread(&LioEstimator::decode_loop, this);
+    map_update_thread = std::thread(&LioEstimator::map_update_loop, this);
+
+    /*** debug record ***/
+    boost::filesystem::create_directories(string(ROOT_DIR) + "/Log");
+    boost::filesystem::create_directories(string(ROOT_DIR) + "/result");
+    fout_out.open(DEBUG_FILE_DIR("mat_out.txt"), ios::out);
+    fout_result.open(RESULT_FILE_DIR("Initialization_result.txt"), ios::out);
+    if (fout_out)
+        cout << "~~~~" << ROOT_DIR << " file opened" << endl;
+    else
+        cout << "~~~~" << ROOT_DIR << " doesn't exist" << endl;
+}
+
+void LioEstimator::pointBodyToWorld(PointType const *const pi, PointType *const po) const {
+    pointBodyToWorld(state, pi, po);
+}
+
+void LioEstimator::pointBodyToWorld(const StatesGroup &s, PointType const *const pi, PointType *const po) {
+    V3D p_body(pi->x, pi->y, pi->z);
+    V3D p_global(s.rot_end * (s.offset_R_L_I * p_body + s.offset_T_L_I) + s.pos_end);
+
+    po->x = p_global(0);
+    po->y = p_global(1);
+    po->z = p_global(2);
+    po->normal_x = pi->normal_x;
+    po->normal_y = pi->normal_y;
+    po->normal_z = pi->normal_z;
+    po->intensity = pi->intensity;
+}
+
+void LioEstimator::RGBpointBodyToWorld(const StatesGroup &s, PointType const *const pi, PointTypeRGB *const po) {
+    V3D p_body(pi->x, pi->y, pi->z);
+    V3D p_global(s.rot_end * (s.offset_R_L_I * p_body + s.offset_T_L_I) + s.pos_end);
+    po->x = p_global(0);
+    po->y = p_global(1);
+    po->z = p_global(2);
+    po->r = pi->normal_x;
+    po->g = pi->normal_y;
+    po->b = pi->normal_z;
+}
+
+void LioEstimator::points_cache_collect() {
+    PointVector points_history;
+    local_map->acquire_removed_points(points_history);
+    points_cache_size = points_history.size();
+    for (int i = 0; i < points_history.size(); i++) _featsArray->push_back(points_history[i]);
+}
+
+/* Parallel stream compaction of the matched points into laserCloudOri: every thread counts the matches of
+   its block, an exclusive scan over the counts gives each block its output offset, then the blocks scatter */
+void LioEstimator::collect_effect_points() {
+    int block_num = 1;
+#ifdef MP_EN
+    block_num = MP_PROC_NUM;
+#endif
+    int block_len = (feats_down_size + block_num - 1) / block_num;
+    vector<int> block_start(block_num + 1, 0);
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel for
+    #endif
+    for (int b = 0; b < block_num; b++) {
+        int end = min(feats_down_size, (b + 1) * block_len), count = 0;
+        for (int i = b * block_len; i < end; i++) count += point_selected_surf[i];
+        block_start[b + 1] = count;
+    }
+    for (int b = 0; b < block_num; b++) block_start[b + 1] += block_start[b];
+
+    effect_feat_num = block_start[block_num];
+    laserCloudOri->resize(effect_feat_num);
+    const float intensity = sqrt(1.0 / LASER_POINT_COV);
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel for
+    #endif
+    for (int b = 0; b < block_num; b++) {
+        int end = min(feats_down_size, (b + 1) * block_len), j = block_start[b];
+        for (int i = b * block_len; i < end; i++) {
+            if (!point_selected_surf[i]) continue;
+            laserCloudOri->points[j] = feats_down_body->points[i];
+            laserCloudOri->points[j].intensity = intensity;
+            j++;
+        }
+    }
+}
+
+void LioEstimator::lasermap_fov_segment() {
+    cub_needrm.clear();
+
+    pointBodyToWorld(XAxisPoint_body, XAxisPoint_world);
+    V3D pos_LiD = state.pos_end;
+
+    if (!Localmap_Initialized) {
+        for (int i = 0; i < 3; i++) {
+            LocalMap_Points.vertex_min[i] = pos_LiD(i) - cube_len / 2.0;
+            LocalMap_Points.vertex_max[i] = pos_LiD(i) + cube_len / 2.0;
+        }
+        Localmap_Initialized = true;
+        return;
+    }
+
+    float dist_to_map_edge[3][2];
+    bool need_move = false;
+    for (int i = 0; i < 3; i++) {
+        dist_to_map_edge[i][0] = fabs(pos_LiD(i) - LocalMap_Points.vertex_min[i]);
+        dist_to_map_edge[i][1] = fabs(pos_LiD(i) - LocalMap_Points.vertex_max[i]);
+        if (dist_to_map_edge[i][0] <= MOV_THRESHOLD * DET_RANGE ||
+            dist_to_map_edge[i][1] <= MOV_THRESHOLD * DET_RANGE)
+            need_move = true;
+    }
+    if (!need_move) return;
+    BoxPointType New_LocalMap_Points, tmp_boxpoints;
+    New_LocalMap_Points = LocalMap_Points;
+    float mov_dist = max((cube_len - 2.0 * MOV_THRESHOLD * DET_RANGE) * 0.5 * 0.9,
+                         double(DET_RANGE * (MOV_THRESHOLD - 1)));
+    for (int i = 0; i < 3; i++) {
+        tmp_boxpoints = LocalMap_Points;
+        if (dist_to_map_edge[i][0] <= MOV_THRESHOLD * DET_RANGE) {
+            New_LocalMap_Points.vertex_max[i] -= mov_dist;
+            New_LocalMap_Points.vertex_min[i] -= mov_dist;
+            tmp_boxpoints.vertex_min[i] = LocalMap_Points.vertex_max[i] - mov_dist;
+            cub_needrm.push_back(tmp_boxpoints);
+        } else if (dist_to_map_edge[i][1] <= MOV_THRESHOLD * DET_RANGE) {
+            New_LocalMap_Points.vertex_max[i] += mov_dist;
+            New_LocalMap_Points.vertex_min[i] += mov_dist;
+            tmp_boxpoints.vertex_max[i] = LocalMap_Points.vertex_min[i] + mov_dist;
+            cub_needrm.push_back(tmp_boxpoints);
+        }
+    }
+    LocalMap_Points = New_LocalMap_Points;
+    points_cache_collect();
+}
+
+/* Runs on the subscription thread, only queues the raw cloud so the executor is never held up by decoding */
+void LioEstimator::feed_lidar(sensor_msgs::msg::PointCloud2::UniquePtr msg) {
+    {
+        // the self sync compares the IMU and LiDAR clocks at arrival, before the scan waits in the decode queue
+        lock_guard<mutex> lock(mtx_buffer);
+        double msg_time = get_time_sec(msg->header.stamp);
+        if (abs(last_timestamp_imu - msg_time) > 1.0 && !timediff_set_flg && !imu_buffer.empty()) {
+            timediff_set_flg = true;
+            timediff_imu_wrt_lidar = last_timestamp_imu - msg_time;
+            printf("Self sync IMU and LiDAR, HARD time lag is %.10lf \n \n", timediff_imu_wrt_lidar);
+        }
+    }
+    size_t dropped_num = decode_queue.dropped();
+    decode_queue.push(std::move(msg), drop_scans_when_busy);
+    if (decode_queue.dropped() > dropped_num)
+        RCLCPP_WARN(rclcpp::get_logger("laserMapping"), "Decode queue full, dropped the oldest scan.");
+}
+
+/* Wait until every queued raw cloud has been decoded into lidar_buffer */
+void LioEstimator::wait_decoded() {
+    decode_queue.wait_done();
+}
+
+void LioEstimator::decode_loop() {
+    sensor_msgs::msg::PointCloud2::UniquePtr msg;
+    while (decode_queue.pop(msg)) {
+        double preprocess_start_time = omp_get_wtime();
+        double msg_time = get_time_sec(msg->header.stamp);
+        int required_frame_num;
+        {
+            lock_guard<mutex> lock(mtx_buffer);
+            scan_count++;
+            required_frame_num = cut_frame_num; // raised by the LI-Init handover
+        }
+
+        /*** p_pre is only used by this thread, so decoding runs without holding mtx_buffer ***/
+        deque<PointCloudXYZI::Ptr> ptr;
+        deque<double> timestamp_lidar;
+        if ((lidar_type == VELO || lidar_type == OUSTER || lidar_type == PANDAR || lidar_type == ROBOSENSE) && cut_frame) {
+            p_pre->process_cut_frame_pcl2(msg, ptr, timestamp_lidar, required_frame_num, scan_count);
+            for (auto &t : timestamp_lidar) t /= double(1000); //unit:s
+        } else {
+            PointCloudXYZI::Ptr ptr_one(new PointCloudXYZI());
+            p_pre->process(msg, ptr_one);
+            ptr.push_back(ptr_one);
+            timestamp_lidar.push_back(msg_time);
+        }
+
+        mtx_buffer.lock();
+        if (msg_time < last_timestamp_lidar) {
+            RCLCPP_ERROR(rclcpp::get_logger("laserMapping"),"lidar loop back, clear Lidar buffer.");
+            lidar_buffer.clear();
+            time_buffer.clear();
+        }
+
+        last_timestamp_lidar = msg_time;
+
+        while (!ptr.empty() && !timestamp_lidar.empty()) {
+            lidar_buffer.push_back(ptr.front());
+            ptr.pop_front();
+            time_buffer.push_back(timestamp_lidar.front());
+            timestamp_lidar.pop_front();
+        }
+        t_preprocess += omp_get_wtime() - preprocess_start_time;
+        preprocess_scan_num++;
+        mtx_buffer.unlock();
+        sig_buffer.notify_all();
+        decode_queue.task_done();
+    }
+}
+
+#ifdef USE_LIVOX
+void LioEstimator::feed_livox(const livox_ros_driver2::msg::CustomMsg::UniquePtr &msg)
+{
+    mtx_buffer.lock();
+    double cur_time = get_time_sec(msg->header.stamp);
+    double preprocess_start_time = omp_get_wtime();
+    scan_count ++;
+    if (!is_first_lidar && cur_time < last_timestamp_lidar)
+    {
+        std::cerr << "lidar loop back, clear buffer" << std::endl;
+        lidar_buffer.clear();
+    }
+    if(is_first_lidar)
+    {
+        is_first_lidar = false;
+    }
+    last_timestamp_lidar = cur_time;
+
+    if (!time_sync_en && abs(last_timestamp_imu - last_timestamp_lidar) > 10.0 && !imu_buffer.empty() && !lidar_buffer.empty() )
+    {
+        printf("IMU and LiDAR not Synced, IMU time: %lf, lidar header time: %lf \n",last_timestamp_imu, last_timestamp_lidar);
+    }
+
+    if (time_sync_en && !timediff_set_flg && abs(last_timestamp_lidar - last_timestamp_imu) > 1 && !imu_buffer.empty())
+    {
+        timediff_set_flg = true;
+        timediff_lidar_wrt_imu = last_timestamp_lidar + 0.1 - last_timestamp_imu;
+        printf("Self sync IMU and LiDAR, time diff is %.10lf \n", timediff_lidar_wrt_imu);
+    }
+
+    PointCloudXYZI::Ptr  ptr(new PointCloudXYZI());
+    p_pre->process(msg, ptr);
+    lidar_buffer.push_back(ptr);
+    time_buffer.push_back(last_timestamp_lidar);
+
+    s_plot11[scan_count] = omp_get_wtime() - preprocess_start_time;
+    mtx_buffer.unlock();
+    sig_buffer.notify_all();
+}
+#endif
+
+void LioEstimator::feed_imu(const sensor_msgs::msg::Imu::UniquePtr &msg_in) {
+    mtx_buffer.lock();
+
+    double time_msg_in = get_time_sec(msg_in->header.stamp);
+
+    if (imu_cnt < 100) {
+        imu_cnt++;
+        mean_acc += (V3D(msg_in->linear_acceleration.x, msg_in->linear_acceleration.y, msg_in->linear_acceleration.z) -
+                     mean_acc) / (imu_cnt);
+        if (imu_cnt > 1) {
+            IMU_period += (time_msg_in - last_time_msg_in - IMU_period) / (imu_cnt - 1);
+        }
+        if (imu_cnt == 99) {
+            cout << endl << "Acceleration norm  : " << mean_acc.norm() << endl;
+            if (IMU_period > 0.01) {
+                cout << "IMU data frequency : " << 1 / IMU_period << " Hz" << endl;
+                RCLCPP_WARN(rclcpp::get_logger("laserMapping"), "IMU data frequency too low. Higher than 150 Hz is recommended.");
+            }
+            cout << endl;
+        }
+    }
+    last_time_msg_in = time_msg_in;
+
+
+    sensor_msgs::msg::Imu::SharedPtr msg(new sensor_msgs::msg::Imu(*msg_in));
+
+    //IMU Time Compensation
+    msg->header.stamp = rclcpp::Time(msg->header.stamp) - rclcpp::Duration::from_seconds(timediff_imu_wrt_lidar - time_lag_IMU_wtr_lidar);
+    double timestamp = get_time_sec(msg->header.stamp);
+
+    if (timestamp < last_timestamp_imu) {
+        RCLCPP_WARN(rclcpp::get_logger("laserMapping"), "IMU loop back, clear IMU buffer.");
+        imu_buffer.clear();
+        Init_LI->IMU_buffer_clear();
+    }
+
+    last_timestamp_imu = timestamp;
+    imu_buffer.push_back(msg);
+
+    // push all IMU meas into Init_LI
+    if (!imu_en && !data_accum_finished)
+        Init_LI->push_ALL_IMU_CalibState(msg, mean_acc_norm);
+
+    mtx_buffer.unlock();
+    sig_buffer.notify_all();
+}
+
+/* Pair the oldest scan with the IMU messages covering it, mtx_buffer must be held */
+bool LioEstimator::sync_buffers(MeasureGroup &meas) {
+    if (lidar_buffer.empty() || imu_buffer.empty()){
+        return false;
+    }
+
+
+    /** push a lidar scan **/
+    if (!lidar_pushed) {
+        meas.lidar = lidar_buffer.front();
+
+        if (meas.lidar->points.size() <= 1) {
+            RCLCPP_WARN(rclcpp::get_logger("laserMapping"), "Too few input point cloud!\n");
+            lidar_buffer.pop_front();
+            time_buffer.pop_front();
+            return false;
+        }
+
+        meas.lidar_beg_time = time_buffer.front(); //unit:s
+
+        if (lidar_type == L515)
+            lidar_end_time = meas.lidar_beg_time;
+        else
+            lidar_end_time = meas.lidar_beg_time + meas.lidar->points.back().curvature / double(1000); //unit:s
+
+        lidar_pushed = true;
+    }
+
+    if (last_timestamp_imu < lidar_end_time)
+        return false;
+
+
+    /** push imu data, and pop from imu buffer **/
+    double imu_time = get_time_sec(imu_buffer.front()->header.stamp);
+    meas.imu.clear();
+    while ((!imu_buffer.empty()) && (imu_time < lidar_end_time)) {
+        imu_time = get_time_sec(imu_buffer.front()->header.stamp);
+        if (imu_time > lidar_end_time) break;
+        meas.imu.push_back(imu_buffer.front());
+        imu_buffer.pop_front();
+    }
+    lidar_buffer.pop_front();
+    time_buffer.pop_front();
+    lidar_pushed = false;
+    return true;
+}
+
+bool LioEstimator::sync_packages(MeasureGroup &meas) {
+    lock_guard<mutex> lock(mtx_buffer);
+    return !flg_exit && sync_buffers(meas);
+}
+
+/* Block until a measure group is ready, stop() is called or the timeout expires */
+bool LioEstimator::wait_packages(MeasureGroup &meas, std::chrono::milliseconds timeout) {
+    unique_lock<mutex> lock(mtx_buffer);
+    bool measures_ready = sig_buffer.wait_for(lock, timeout, [&] { return flg_exit || sync_buffers(meas); });
+    return measures_ready && !flg_exit;
+}
+
+void LioEstimator::stop() {
+    {
+        lock_guard<mutex> lock(mtx_buffer);
+        flg_exit = true;
+    }
+    sig_buffer.notify_all();
+    decode_queue.close();
+    if (decode_thread.joinable()) decode_thread.join();
+}
+
+bool LioEstimator::stopped() {
+    lock_guard<mutex> lock(mtx_buffer);
+    return flg_exit;
+}
+
+void LioEstimator::map_update_loop() {
+    int feats_size;
+    while (map_queue.pop(feats_size)) {
+        map_feats_size = feats_size;
+        map_incremental();
+        map_queue.task_done();
+    }
+}
+
+/* Runs on map_update_thread with the scan handed over in map_state / map_feats_* */
+void LioEstimator::map_incremental() {
+    double t_start = omp_get_wtime();
+    PointVector PointToAdd;
+    PointVector PointNoNeedDownsample;
+    PointToAdd.reserve(map_feats_size);
+    PointNoNeedDownsample.reserve(map_feats_size);
+    for (int i = 0; i < map_feats_size; i++) {
+        /* transform to world frame */
+        pointBodyToWorld(map_state, &(map_feats_body->points[i]), &(map_feats_world->points[i]));
+        /* decide if need add to map */
+        if (!map_nearest_points[i].empty() && flg_EKF_inited) {
+            const PointVector &points_near = map_nearest_points[i];
+            bool need_add = true;
+            PointType downsample_result, mid_point;
+            mid_point.x = floor(map_feats_world->points[i].x / filter_size_map_min) * filter_size_map_min +
+                          0.5 * filter_size_map_min;
+            mid_point.y = floor(map_feats_world->points[i].y / filter_size_map_min) * filter_size_map_min +
+                          0.5 * filter_size_map_min;
+            mid_point.z = floor(map_feats_world->points[i].z / filter_size_map_min) * filter_size_map_min +
+                          0.5 * filter_size_map_min;
+            float dist = calc_dist(map_feats_world->points[i], mid_point);
+            if (fabs(points_near[0].x - mid_point.x) > 0.5 * filter_size_map_min &&
+                fabs(points_near[0].y - mid_point.y) > 0.5 * filter_size_map_min &&
+                fabs(points_near[0].z - mid_point.z) > 0.5 * filter_size_map_min) {
+                PointNoNeedDownsample.push_back(map_feats_world->points[i]);
+                continue;
+            }
+            for (int readd_i = 0; readd_i < NUM_MATCH_POINTS; readd_i++) {
+                if (points_near.size() < NUM_MATCH_POINTS) break;
+                if (calc_dist(points_near[readd_i], mid_point) < dist) {
+                    need_add = false;
+                    break;
+                }
+            }
+            if (need_add) PointToAdd.push_back(map_feats_world->points[i]);
+        } else {
+            PointToAdd.push_back(map_feats_world->points[i]);
+        }
+    }
+
+    local_map->Add_Points(PointToAdd, true);
+    local_map->Add_Points(PointNoNeedDownsample, false);
+    add_point_size = PointToAdd.size() + PointNoNeedDownsample.size();
+    kdtree_size_end = local_map->size();
+    t_map_incre += omp_get_wtime() - t_start;
+}
+
+/*
+ * Seeds the local map from a map file written by save_map, the points are converted straight from the file
+ * mapping into the build storage. Scans are registered against it from the first one, so the session has
+ * to start where the one that wrote the map started.
+ */
+bool LioEstimator::load_map(const string &path) {
+    double t_start = omp_get_wtime();
+    MappedMapFile map_file;
+    if (!map_file.open(path)) return false;
+    int point_num = map_file.size();
+    const MapFilePoint *mapped = map_file.points();
+    PointVector points(point_num);
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel for
+    #endif
+    for (int i = 0; i < point_num; i++) {
+        points[i].x = mapped[i].x;
+        points[i].y = mapped[i].y;
+        points[i].z = mapped[i].z;
+        points[i].intensity = mapped[i].intensity;
+    }
+    map_file.close();
+    double t_read = omp_get_wtime();
+    local_map->Build(std::move(points));
+    printf("[Map] Loaded %d points from %s in %.3f s (read %.3f s, build %.3f s)\n", point_num, path.c_str(),
+           omp_get_wtime() - t_start, t_read - t_start, omp_get_wtime() - t_read);
+    return point_num > 0;
+}
+
+bool LioEstimator::save_map(const string &path) {
+    wait_map_update();
+    PointVector points;
+    local_map->get_points(points);
+    if (!save_map_file(path, points, filter_size_map_min)) return false;
+    printf("[Map] Saved %zu points to %s\n", points.size(), path.c_str());
+    return true;
+}
+
+void LioEstimator::wait_map_update() {
+    double t_start = omp_get_wtime();
+    map_queue.wait_done();
+    t_map_wait += omp_get_wtime() - t_start;
+}
+
+void LioEstimator::fileout_calib_result() {
+    fout_result.setf(ios::fixed);
+    fout_result << setprecision(6)
+                << "Rotation LiDAR to IMU (degree)     = " << RotMtoEuler(state.offset_R_L_I).transpose() * 57.3
+                << endl;
+    fout_result << "Translation LiDAR to IMU (meter)   = " << state.offset_T_L_I.transpose() << endl;
+    fout_result << "Time Lag IMU to LiDAR (second)     = " << time_lag_IMU_wtr_lidar + timediff_imu_wrt_lidar << endl;
+    fout_result << "Bias of Gyroscope  (rad/s)         = " << state.bias_g.transpose() << endl;
+    fout_result << "Bias of Accelerometer (meters/s^2) = " << state.bias_a.transpose() << endl;
+    fout_result << "Gravity in World Frame(meters/s^2) = " << state.gravity.transpose() << endl << endl;
+
+    MD(4, 4) Transform;
+    Transform.setIdentity();
+    Transform.block<3, 3>(0, 0) = state.offset_R_L_I;
+    Transform.block<3, 1>(0, 3) = state.offset_T_L_I;
+    fout_result << "Homogeneous Transformation Matrix from LiDAR to IMU: " << endl;
+    fout_result << Transform << endl << endl << endl;
+}
+
+void LioEstimator::print_refine_result() {
+    cout.setf(ios::fixed);
+    cout << endl;
+    printf(BOLDGREEN "[Final Result] " RESET);
+    cout << setprecision(6)
+         << "Rotation LiDAR to IMU    = " << RotMtoEuler(state.offset_R_L_I).transpose() * 57.3 << " deg" << endl;
+    printf(BOLDGREEN "[Final Result] " RESET);
+    cout << "Translation LiDAR to IMU = " << state.offset_T_L_I.transpose() << " m" << endl;
+    printf(BOLDGREEN "[Final Result] " RESET);
+    printf("Time Lag IMU to LiDAR    = %.8lf s \n", time_lag_IMU_wtr_lidar + timediff_imu_wrt_lidar);
+    printf(BOLDGREEN "[Final Result] " RESET);
+    cout << "Bias of Gyroscope        = " << state.bias_g.transpose() << " rad/s" << endl;
+    printf(BOLDGREEN "[Final Result] " RESET);
+    cout << "Bias of Accelerometer    = " << state.bias_a.transpose() << " m/s^2" << endl;
+    printf(BOLDGREEN "[Final Result] " RESET);
+    cout << "Gravity in World Frame   = " << state.gravity.transpose() << " m/s^2" << endl;
+}
+
+void LioEstimator::print_stage_stats(double wall_time, double data_time) {
+    wait_map_update();
+    auto print_stage = [](const char *name, double t_total, int num) {
+        double t_mean = num > 0 ? t_total / num : 0.0;
+        printf("%-24s total %9.3f s | mean %8.3f ms | %9.1f scans/s\n", name, t_total, t_mean * 1000.0,
+               t_mean > 0.0 ? 1.0 / t_mean : 0.0);
+    };
+    cout << endl << BOLDCYAN << "[Offline] Per-stage throughput" << RESET << endl;
+    print_stage("Preprocess", t_preprocess, preprocess_scan_num);
+    print_stage("Undistort", t_undistort, processed_scan_num);
+    print_stage("Downsample", t_downsample, processed_scan_num);
+    print_stage("IEKF update", t_iekf, processed_scan_num);
+    print_stage("Map incremental", t_map_incre, processed_scan_num);
+    print_stage("Map update wait", t_map_wait, processed_scan_num);
+    print_stage("Publish", t_publish, processed_scan_num);
+    KD_TREE_STATS map_stats;
+    if (local_map->get_stats(map_stats))
+        printf("Local map: %d points, %d deleted not freed, %.1f nodes per search, %lu + %lu rebuilds (mean %.3f / %.3f "
+               "ms, rebuild thread second)\n",
+               map_stats.valid_num, map_stats.tree_size - map_stats.valid_num,
+               map_stats.search_queries > 0 ? double(map_stats.search_nodes_visited) / map_stats.search_queries : 0.0,
+               (unsigned long)map_stats.rebuild.count, (unsigned long)map_stats.thread_rebuild.count,
+               map_stats.rebuild.mean_us() * 1e-3, map_stats.thread_rebuild.mean_us() * 1e-3);
+    if (decode_queue.dropped() > 0) printf("Dropped %zu scans at the decode queue\n", decode_queue.dropped());
+    printf("Processed %d scans in %.3f s wall time, %.3f s of data (%.1fx realtime)\n", processed_scan_num,
+           wall_time, data_time, wall_time > 0.0 ? data_time / wall_time : 0.0);
+}
+
+/* Run one IEKF step on a synced measure group, returns false if no state was estimated for it */
+bool LioEstimator::process(const MeasureGroup &meas) {
+    VD(DIM_STATE) solution;
+    MD(12, 12) H_T_H;
+    VD(12) H_T_R_inv_z;
+    MD(DIM_STATE, 12) K_x;
+    V3D rot_add, T_add;
+    StatesGroup state_propagat;
+
+    bool flg_EKF_converged, EKF_stop_flg = 0;
+
+    if (flg_reset) {
+        RCLCPP_WARN(rclcpp::get_logger("laserMapping"), "reset when rosbag play back.");
+        p_imu->Reset();
+        flg_reset = false;
+        return false;
+    }
+
+
+    if (feats_undistort->empty() || (feats_undistort == NULL)) {
+        first_lidar_time = meas.lidar_beg_time;
+        p_imu->first_lidar_time = first_lidar_time;
+        RCLCPP_WARN(rclcpp::get_logger("laserMapping"), "LI-Init not ready, no points stored.");
+    }
+
+    /*** every scan gets fresh clouds, so the ones handed to the state callback are never written again ***/
+    double t0 = omp_get_wtime();
+    PointCloudXYZI::Ptr undistort_out(new PointCloudXYZI());
+    p_imu->Process(meas, state, undistort_out);
+    if (!undistort_out->empty()) feats_undistort = undistort_out; // the IMU init steps return without undistorting
+    state_propagat = state;
+    double t1 = omp_get_wtime();
+
+
+    /*** downsample the feature points in a scan ***/
+    feats_down_body.reset(new PointCloudXYZI());
+    downSizeFilterSurf.setInputCloud(feats_undistort);
+    downSizeFilterSurf.filter(*feats_down_body);
+    feats_down_size = feats_down_body->points.size();
+    double t2 = omp_get_wtime();
+    t_undistort += t1 - t0;
+    t_downsample += t2 - t1;
+
+    /*** the previous scan must be in the map before segmenting and registering against it ***/
+    wait_map_update();
+
+    /*** Segment the map in lidar FOV ***/
+    lasermap_fov_segment();
+    double t_reg = omp_get_wtime();
+
+    /*** initialize the local map ***/
+    if (local_map->empty()) {
+        if (feats_down_size > 5) {
+            feats_down_world->resize(feats_down_size);
+            for (int i = 0; i < feats_down_size; i++) {
+                pointBodyToWorld(&(feats_down_body->points[i]), &(feats_down_world->points[i]));
+            }
+            local_map->Build(feats_down_world->points);
+        }
+        return false;
+    }
+    kdtree_size_st = local_map->size();
+
+
+    /*** ICP and iterated Kalman filter update ***/
+    feats_down_world->resize(feats_down_size);
+    euler_cur = RotMtoEuler(state.rot_end);
+
+
+    Nearest_Points.resize(feats_down_size);
+    point_selected_surf.resize(feats_down_size);
+    int rematch_num = 0;
+    bool nearest_search_en = true;
+
+
+    /*** iterated state estimation ***/
+    // the prior covariance stays fixed over the iterations, its 12x12 block seen by Hsub is factored once per scan
+    IekfInfoUpdate<DIM_STATE, 12> info_update(state.cov);
+    const double R_inv = 1.0 / LASER_POINT_COV; // weight of every point-to-plane residual
+    int thread_num = 1;
+#ifdef MP_EN
+    thread_num = MP_PROC_NUM;
+#endif
+    vector<MD(12, 12), Eigen::aligned_allocator<MD(12, 12)>> H_T_H_thread(thread_num);
+    vector<VD(12), Eigen::aligned_allocator<VD(12)>> H_T_z_thread(thread_num);
+
+
+
+
+    for (iterCount = 0; iterCount < NUM_MAX_ITERATIONS; iterCount++) {
+
+
+        /** closest surface search and residual computation, the Jacobian rows of the matched points are
+            accumulated straight into per-thread H^T R^-1 H and H^T R^-1 z **/
+        for (int t = 0; t < thread_num; t++) {
+            H_T_H_thread[t].setZero();
+            H_T_z_thread[t].setZero();
+        }
+        /// transform to world frame
+        #ifdef MP_EN
+            omp_set_num_threads(MP_PROC_NUM);
+            #pragma omp parallel for
+        #endif
+        for (int i = 0; i < feats_down_size; i++)
+            pointBodyToWorld(&feats_down_body->points[i], &feats_down_world->points[i]);
+
+        /** Find the closest surfaces in the map, one batch for the whole scan **/
+        if (nearest_search_en)
+            local_map->Nearest_Search_Batch(feats_down_world->points, NUM_MATCH_POINTS, Nearest_Points, Nearest_Dist, 5);
+
+        #ifdef MP_EN
+            omp_set_num_threads(MP_PROC_NUM);
+            #pragma omp parallel for
+        #endif
+        for (int i = 0; i < feats_down_size; i++) {
+            PointType &point_body = feats_down_body->points[i];
+            PointType &point_world = feats_down_world->points[i];
+            V3D p_body(point_body.x, point_body.y, point_body.z);
+            auto &points_near = Nearest_Points[i];
+
+            if (nearest_search_en) {
+                if (points_near.size() < NUM_MATCH_POINTS)
+                    point_selected_surf[i] = false;
+                else
+                    point_selected_surf[i] = !(Nearest_Dist[i][NUM_MATCH_POINTS - 1] > 5);
+            }
+
+            if (!point_selected_surf[i] || points_near.size() < NUM_MATCH_POINTS) {
+                point_selected_surf[i] = false;
+                continue;
+            }
+
+            point_selected_surf[i] = false;
+            VD(4) pabcd;
+            pabcd.setZero();
+            if (esti_plane(pabcd, points_near, 0.1)) //(planeValid)
+            {
+                float pd2 = pabcd(0) * point_world.x + pabcd(1) * point_world.y + pabcd(2) * point_world.z +
+                            pabcd(3);
+                float s = 1 - 0.9 * fabs(pd2) / sqrt(p_body.norm());
+
+                if (s > 0.9) {
+                    point_selected_surf[i] = true;
+
+                    /*** calculate the Measurement Jacobian row and the measurement: distance to the surface ***/
+                    V3D point_this = state.offset_R_L_I * p_body + state.offset_T_L_I;
+                    M3D point_crossmat;
+                    point_crossmat << SKEW_SYM_MATRX(point_this);
+                    V3D norm_vec(pabcd(0), pabcd(1), pabcd(2));
+                    V3D A(point_crossmat * state.rot_end.transpose() * norm_vec);
+                    VD(12) h;
+                    if (imu_en) {
+                        M3D point_this_L_cross;
+                        point_this_L_cross << SKEW_SYM_MATRX(p_body);
+                        V3D H_R_LI = point_this_L_cross * state.offset_R_L_I.transpose() * state.rot_end.transpose() *
+                                     norm_vec;
+                        V3D H_T_LI = state.rot_end.transpose() * norm_vec;
+                        h << VEC_FROM_ARRAY(A), VEC_FROM_ARRAY(norm_vec), VEC_FROM_ARRAY(H_R_LI), VEC_FROM_ARRAY(H_T_LI);
+                    } else {
+                        h << VEC_FROM_ARRAY(A), VEC_FROM_ARRAY(norm_vec), 0, 0, 0, 0, 0, 0;
+                    }
+                    int tid = omp_get_thread_num();
+                    H_T_H_thread[tid].noalias() += R_inv * h * h.transpose();
+                    H_T_z_thread[tid].noalias() -= R_inv * double(pd2) * h;
+                }
+            }
+        }
+        H_T_H.setZero();
+        H_T_R_inv_z.setZero();
+        for (int t = 0; t < thread_num; t++) {
+            H_T_H += H_T_H_thread[t];
+            H_T_R_inv_z += H_T_z_thread[t];
+        }
+
+        EKF_stop_flg = false;
+        flg_EKF_converged = false;
+
+        /*** Iterative Kalman Filter Update ***/
+        // K = (H^T R^-1 H + P^-1)^-1 H^T R^-1 = K_x Hsub^T R^-1, see IekfInfoUpdate
+        K_x = info_update.gain(H_T_H);
+        solution = IekfInfoUpdate<DIM_STATE, 12>::increment(K_x, H_T_H, H_T_R_inv_z, state_propagat - state);
+
+        //state update
+        state += solution;
+
+        rot_add = solution.block<3, 1>(0, 0);
+        T_add = solution.block<3, 1>(3, 0);
+
+
+        if ((rot_add.norm() * 57.3 < 0.01) && (T_add.norm() * 100 < 0.015))
+            flg_EKF_converged = true;
+
+        euler_cur = RotMtoEuler(state.rot_end);
+
+        /*** Rematch Judgement ***/
+        nearest_search_en = false;
+        if (flg_EKF_converged || ((rematch_num == 0) && (iterCount == (NUM_MAX_ITERATIONS - 2)))) {
+            nearest_search_en = true;
+            rematch_num++;
+        }
+
+        /*** Convergence Judgements and Covariance Update ***/
+        if (!EKF_stop_flg && (rematch_num >= 2 || (iterCount == NUM_MAX_ITERATIONS - 1))) {
+            if (flg_EKF_inited) {
+                /*** Covariance Update ***/
+                state.cov = IekfInfoUpdate<DIM_STATE, 12>::covariance(K_x, H_T_H, state.cov);
+                total_distance += (state.pos_end - position_last).norm();
+                position_last = state.pos_end;
+
+                tf2::Quaternion quat;
+                if (!imu_en) {
+                    // Generate quaternion from roll, pitch, yaw
+                    quat.setRPY(euler_cur(0), euler_cur(1), euler_cur(2));
+                } else {
+                    //Publish LiDAR's pose, instead of IMU's pose
+                    M3D rot_cur_lidar = state.rot_end * state.offset_R_L_I;
+                    V3D euler_cur_lidar = RotMtoEuler(rot_cur_lidar);
+                    quat.setRPY(euler_cur_lidar(0), euler_cur_lidar(1), euler_cur_lidar(2));
+                }
+
+                // Convert tf2::Quaternion to geometry_msgs::msg::Quaternion
+                geoQuat = tf2::toMsg(quat);
+            }
+            EKF_stop_flg = true;
+        }
+
+        if (EKF_stop_flg) break;
+    }
+    // the matches of the last iteration are the effect points handed to the state callback
+    collect_effect_points();
+    double t3 = omp_get_wtime();
+
+    /******* Publish odometry and points *******/
+    if (state_callback) state_callback();
+    last_odom = state.pos_end;
+    last_rot = state.rot_end;
+    double t4 = omp_get_wtime();
+
+    /*** add the feature points to map kdtree, overlapped with undistorting the next scan ***/
+    map_state = state;
+    map_feats_body = feats_down_body;
+    std::swap(map_feats_world, feats_down_world);
+    std::swap(map_nearest_points, Nearest_Points);
+    map_queue.push(int(feats_down_size), false);
+
+    /***** Device starts to move, data accmulation begins. ****/
+    if (!imu_en && !data_accum_start && state.pos_end.norm() > 0.05) {
+        printf(BOLDCYAN "[Initialization] Movement detected, data accumulation starts.\n\n\n\n\n" RESET);
+        data_accum_start = true;
+        move_start_time = lidar_end_time;
+    }
+
+    t_iekf += t3 - t_reg;
+    t_publish += t4 - t3;
+    processed_scan_num++;
+
+    update_calibration();
+    return true;
+}
+
+/* LI-Init data accumulation, the handover to the IMU-aided filter and the online refinement progress */
+void LioEstimator::update_calibration() {
+    frame_num++;
+    V3D ext_euler = RotMtoEuler(state.offset_R_L_I);
+    fout_out << euler_cur.transpose() * 57.3 << " " << state.pos_end.transpose() << " "
+             << ext_euler.transpose() * 57.3 << " " \
+             << state.offset_T_L_I.transpose() << " " << state.vel_end.transpose() << " "  \
+             << " " << state.bias_g.transpose() << " " << state.bias_a.transpose() * 0.9822 / 9.81 << " "
+             << state.gravity.transpose() << " " << total_distance << endl;
+
+    //Broadcast every second
+    if (imu_en && frame_num % orig_odom_freq * cut_frame_num == 0 && !online_calib_finish) {
+        double online_calib_completeness = lidar_end_time - online_calib_starts_time;
+        online_calib_completeness =
+                online_calib_completeness < online_refine_time ? online_calib_completeness : online_refine_time;
+        cout << "\x1B[2J\x1B[H"; //clear the screen
+        if(online_refine_time > 0.1)
+            printProgress(online_calib_completeness / online_refine_time);
+        if (!refine_print && online_calib_completeness > (online_refine_time - 1e-6)) {
+            refine_print = true;
+            online_calib_finish = true;
+            cout << endl;
+            print_refine_result();
+            fout_result << "Refinement result:" << endl;
+            fileout_calib_result();
+            std::string path = ament_index_cpp::get_package_share_directory("lidar_imu_init");
+            path += "/result/Initialization_result.txt";
+            cout << endl  << "Initialization and refinement result is written to " << endl << BOLDGREEN << path << RESET <<endl;
+        }
+    }
+
+
+    if (!imu_en && !data_accum_finished && data_accum_start) {
+        //Push Lidar's Angular velocity and linear velocity
+        Init_LI->push_Lidar_CalibState(state.rot_end, state.bias_g, state.vel_end, lidar_end_time);
+        //Data Accumulation Sufficience Appraisal
+        bool data_sufficient = Init_LI->data_sufficiency_assess(Jaco_rot, frame_num, state.bias_g,
+                                                                orig_odom_freq, cut_frame_num);
+
+        if (data_sufficient) {
+            // feed_imu pushes into Init_LI and reads the time lag from the subscription thread
+            lock_guard<mutex> lock(mtx_buffer);
+            data_accum_finished = true;
+            Init_LI->LI_Initialization(orig_odom_freq, cut_frame_num, timediff_imu_wrt_lidar, move_start_time);
+
+            online_calib_starts_time = lidar_end_time;
+
+            //Transfer to FAST-LIO2
+            imu_en = true;
+            state.offset_R_L_I = Init_LI->get_R_LI();
+            state.offset_T_L_I = Init_LI->get_T_LI();
+            state.pos_end = -state.rot_end * state.offset_R_L_I.transpose() * state.offset_T_L_I +
+                            state.pos_end; //Body frame is IMU frame in FAST-LIO mode
+            state.rot_end = state.rot_end * state.offset_R_L_I.transpose();
+            state.gravity = Init_LI->get_Grav_L0();
+            state.bias_g = Init_LI->get_gyro_bias();
+            state.bias_a = Init_LI->get_acc_bias();
+
+
+            if (lidar_type != AVIA)
+                cut_frame_num = 2;
+
+            time_lag_IMU_wtr_lidar = Init_LI->get_total_time_lag(); //Compensate IMU's time in the buffer
+            for (int i = 0; i < imu_buffer.size(); i++) {
+                imu_buffer[i]->header.stamp = rclcpp::Time(imu_buffer[i]->header.stamp)- rclcpp::Duration::from_seconds(time_lag_IMU_wtr_lidar);
+            }
+
+            p_imu->imu_en = imu_en;
+            p_imu->LI_init_done = true;
+            p_imu->set_mean_acc_norm(mean_acc_norm);
+            p_imu->set_gyr_cov(V3D(0.1, 0.1, 0.1));
+            p_imu->set_acc_cov(V3D(0.1, 0.1, 0.1));
+            p_imu->set_gyr_bias_cov(V3D(0.0001, 0.0001, 0.0001));
+            p_imu->set_acc_bias_cov(V3D(0.0001, 0.0001, 0.0001));
+
+            //Output Initialization result
+            fout_result << "Initialization result:" << endl;
+            fileout_calib_result();
+        }
+    }
+}
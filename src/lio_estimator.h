@@ -0,0 +1,197 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <common_lib.h>
+#include <bounded_queue.hpp>
+#include <pcl/filters/voxel_grid.h>
+#include <geometry_msgs/msg/quaternion.hpp>
+#include "preprocess.h"
+#include "local_map.h"
+#include "map_file.h"
+#include <LI_init/LI_init.h>
+
+#ifdef USE_LIVOX
+#include <livox_ros_driver/CustomMsg.h>
+#endif
+
+#define LASER_POINT_COV     (0.001)
+
+class ImuProcess; // IMU_Processing.hpp defines its members, so it is only included by lio_estimator.cpp
+
+/*
+ * LiDAR-inertial estimator: owns the sensor buffers, the ikd-Tree map, the IEKF state and the LI-Init
+ * calibration. Sensor data is fed from the subscription thread, measures are pulled and processed by a
+ * single estimator thread, so several estimators can live in the same process.
+ *
+ * Scans go through a pipeline: raw clouds are decoded by Preprocess on a decode thread behind a bounded
+ * queue, undistortion/downsampling and the IEKF run on the estimator thread, and the map update of scan k
+ * runs on a map update thread, fed through a second bounded queue, while scan k+1 is undistorted and
+ * downsampled. Undistorting k+1 needs the
+ * posterior of k and registering k+1 needs the map of k, so those two stay serialized.
+ */
+class LioEstimator
+{
+  public:
+    LioEstimator();
+    ~LioEstimator();
+
+    void init();
+
+    void feed_lidar(sensor_msgs::msg::PointCloud2::UniquePtr msg);
+#ifdef USE_LIVOX
+    void feed_livox(const livox_ros_driver2::msg::CustomMsg::UniquePtr &msg);
+#endif
+    void feed_imu(const sensor_msgs::msg::Imu::UniquePtr &msg_in);
+
+    bool sync_packages(MeasureGroup &meas);
+    bool wait_packages(MeasureGroup &meas, std::chrono::milliseconds timeout);
+    void wait_decoded();
+    bool process(const MeasureGroup &meas);
+    void stop();
+    bool stopped();
+    bool load_map(const string &path);
+    bool save_map(const string &path);
+    bool get_map_stats(KD_TREE_STATS &stats) { return local_map && local_map->get_stats(stats); }
+
+    /* Called from process() once the state of the current scan is estimated, before the map is updated */
+    void set_state_callback(std::function<void()> cb) { state_callback = cb; }
+
+    void pointBodyToWorld(PointType const *const pi, PointType *const po) const;
+    static void pointBodyToWorld(const StatesGroup &s, PointType const *const pi, PointType *const po);
+    static void RGBpointBodyToWorld(const StatesGroup &s, PointType const *const pi, PointTypeRGB *const po);
+    template<typename T>
+    void pointBodyToWorld(const Matrix<T, 3, 1> &pi, Matrix<T, 3, 1> &po) const {
+        V3D p_body(pi[0], pi[1], pi[2]);
+        V3D p_global(state.rot_end * (state.offset_R_L_I * p_body + state.offset_T_L_I) + state.pos_end);
+        po[0] = p_global(0);
+        po[1] = p_global(1);
+        po[2] = p_global(2);
+    }
+    void print_refine_result();
+    void print_stage_stats(double wall_time, double data_time);
+
+    /*** parameters, set before init() ***/
+    int NUM_MAX_ITERATIONS = 0, lidar_type = AVIA, cut_frame_num = 1, orig_odom_freq = 10;
+    bool cut_frame = true;
+    float DET_RANGE = 300.0f;
+    double filter_size_surf_min = 0, filter_size_map_min = 0, cube_len = 0;
+    string map_backend = "ikdtree";
+    int ikdtree_build_threads = MP_PROC_NUM, bucket_leaf_size = 32;
+    double knn_epsilon = 0.0;
+    int knn_max_visits = 0;
+    double ikdtree_delete_param = 0.5, ikdtree_balance_param = 0.6;
+    double ivox_resolution = 0.5;
+    int ivox_nearby_type = 18, ivox_capacity = 1000000;
+    double gyr_cov = 0.1, acc_cov = 0.1, grav_cov = 0.0001, b_gyr_cov = 0.0001, b_acc_cov = 0.0001;
+    double online_refine_time = 20.0; //unit: s
+    double mean_acc_norm = 9.81;
+    int decode_queue_len = 4;
+    bool drop_scans_when_busy = true; // false blocks feed_lidar instead, for offline replay
+    vector<double> Trans_LI_cov = vector<double>(3, 0.0005);
+    vector<double> Rot_LI_cov = vector<double>(3, 0.00005);
+
+    shared_ptr<Preprocess> p_pre;
+    shared_ptr<ImuProcess> p_imu;
+    shared_ptr<LI_Init> Init_LI;
+
+    /*** estimator outputs, valid inside the state callback ***/
+    // all clouds but laserCloudOri are reallocated for every scan, a held pointer keeps its content
+    StatesGroup state;
+    geometry_msgs::msg::Quaternion geoQuat;
+    double lidar_end_time = 0;
+    bool imu_en = false, online_calib_finish = false;
+    int effect_feat_num = 0;
+    PointCloudXYZI::Ptr feats_undistort;
+    PointCloudXYZI::Ptr feats_down_body;
+    PointCloudXYZI::Ptr laserCloudOri;
+    PointCloudXYZI::Ptr featsFromMap;
+
+    // Time Log Variables
+    double t_preprocess = 0.0, t_undistort = 0.0, t_downsample = 0.0, t_iekf = 0.0, t_map_incre = 0.0, t_publish = 0.0;
+    double t_map_wait = 0.0;
+    int preprocess_scan_num = 0, processed_scan_num = 0;
+
+  private:
+    bool sync_buffers(MeasureGroup &meas);
+    void decode_loop();
+    void points_cache_collect();
+    void lasermap_fov_segment();
+    void collect_effect_points();
+    void map_update_loop();
+    void map_incremental();
+    void wait_map_update();
+    void fileout_calib_result();
+    void update_calibration();
+
+    mutex mtx_buffer;
+    condition_variable sig_buffer;
+    bool flg_exit = false;
+    std::function<void()> state_callback;
+
+    BoundedQueue<sensor_msgs::msg::PointCloud2::UniquePtr> decode_queue;
+    // one entry per scan to add to the map, its points are handed over in map_state / map_feats_*
+    BoundedQueue<int> map_queue{1};
+    std::thread decode_thread, map_update_thread;
+
+    deque<PointCloudXYZI::Ptr> lidar_buffer;
+    deque<double> time_buffer;
+    deque<sensor_msgs::msg::Imu::SharedPtr> imu_buffer;
+    double last_timestamp_lidar = 0, last_timestamp_imu = 0.0;
+    double timediff_imu_wrt_lidar = 0.0;
+    bool timediff_set_flg = false;
+    bool lidar_pushed = false, flg_reset = false, flg_EKF_inited = true;
+    int scan_count = 0;
+    double IMU_period = 0.0, last_time_msg_in = 0.0;
+    int imu_cnt = 0;
+
+    int iterCount = 0, feats_down_size = 0;
+    int kdtree_size_st = 0, kdtree_size_end = 0, add_point_size = 0;
+    double total_distance = 0, first_lidar_time = 0.0;
+
+    // LI-Init
+    bool data_accum_finished = false, data_accum_start = false, refine_print = false;
+    int frame_num = 0;
+    double time_lag_IMU_wtr_lidar = 0.0, move_start_time = 0.0, online_calib_starts_time = 0.0;
+    V3D mean_acc = Zero3d;
+    MatrixXd Jaco_rot;
+    ofstream fout_out, fout_result;
+
+    vector<BoxPointType> cub_needrm;
+    // per-point buffers of the current scan, resized per scan but never shrunk so that their capacity
+    // settles at the largest scan seen and steady state runs without reallocation
+    vector<PointVector> Nearest_Points;
+    vector<vector<float>> Nearest_Dist;
+    vector<uint8_t> point_selected_surf;
+
+    PointCloudXYZI::Ptr feats_down_world;
+    // scan handed over to the map update thread, rewritten only after wait_map_update()
+    StatesGroup map_state;
+    PointCloudXYZI::Ptr map_feats_body, map_feats_world;
+    vector<PointVector> map_nearest_points;
+    int map_feats_size = 0;
+    PointCloudXYZI::Ptr _featsArray;
+
+    pcl::VoxelGrid<PointType> downSizeFilterSurf;
+    pcl::VoxelGrid<PointType> downSizeFilterMap;
+
+    std::unique_ptr<LocalMap> local_map;
+    BoxPointType LocalMap_Points;
+    bool Localmap_Initialized = false;
+    int points_cache_size = 0;
+
+    M3D last_rot = M3D::Zero();
+    V3F XAxisPoint_body = V3F(LIDAR_SP_LEN, 0.0, 0.0);
+    V3F XAxisPoint_world = V3F(LIDAR_SP_LEN, 0.0, 0.0);
+    V3D euler_cur;
+    V3D position_last = Zero3d;
+    V3D last_odom = Zero3d;
+
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
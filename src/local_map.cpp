@@ -0,0 +1,704 @@
+#include "local_map.h"
+#ifdef MP_EN
+#include <omp.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Half-open like the boxes of the ikd-Tree */
+static inline bool box_contains(const BoxPointType &box, const PointType &p) {
+    return p.x >= box.vertex_min[0] && p.x < box.vertex_max[0] && p.y >= box.vertex_min[1] &&
+           p.y < box.vertex_max[1] && p.z >= box.vertex_min[2] && p.z < box.vertex_max[2];
+}
+
+IkdTreeMap::IkdTreeMap(float box_length, int build_threads) : tree(new KD_TREE())
+{
+    tree->set_downsample_param(box_length);
+    tree->set_build_threads(build_threads);
+}
+
+void IkdTreeMap::Nearest_Search_Batch(const PointVector &points, int k_nearest, vector<PointVector> &Nearest_Points,
+                                      vector<vector<float>> &Point_Distance, double max_dist) {
+    tree->Nearest_Search_Batch(points, k_nearest, Nearest_Points, Point_Distance, max_dist);
+}
+
+VoxelHashMap::VoxelHashMap(float resolution, float downsample_size, int nearby_type, size_t capacity)
+    : resolution(resolution), downsample_size(downsample_size), capacity(capacity > 0 ? capacity : 1)
+{
+    if (nearby_type != 0 && nearby_type != 6 && nearby_type != 18 && nearby_type != 26) {
+        printf("[ivox] Unsupported nearby type %d, falling back to 18.\n", nearby_type);
+        nearby_type = 18;
+    }
+    // the voxel of the query first, then faces (6), edges (18) and corners (26)
+    nearby_offsets.push_back({0, 0, 0});
+    for (int manhattan = 1; manhattan <= 3; manhattan++) {
+        if ((manhattan == 1 && nearby_type < 6) || (manhattan == 2 && nearby_type < 18) ||
+            (manhattan == 3 && nearby_type < 26))
+            break;
+        for (int dx = -1; dx <= 1; dx++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dz = -1; dz <= 1; dz++)
+                    if (abs(dx) + abs(dy) + abs(dz) == manhattan) nearby_offsets.push_back({dx, dy, dz});
+    }
+}
+
+VoxelHashMap::VoxelKey VoxelHashMap::key_of(const PointType &point, float cell) const {
+    return {int(floor(point.x / cell)), int(floor(point.y / cell)), int(floor(point.z / cell))};
+}
+
+void VoxelHashMap::Build(PointVector points) {
+    voxels.clear();
+    voxel_list.clear();
+    point_num = 0;
+    for (const PointType &point : points) add_point(point, false);
+}
+
+void VoxelHashMap::get_points(PointVector &points) {
+    points.clear();
+    points.reserve(point_num);
+    for (const auto &voxel : voxel_list) points.insert(points.end(), voxel.second.begin(), voxel.second.end());
+}
+
+int VoxelHashMap::Add_Points(PointVector &points, bool downsample_on) {
+    int added = 0;
+    for (const PointType &point : points) added += add_point(point, downsample_on);
+    return added;
+}
+
+/* Returns true if the map gained a point */
+bool VoxelHashMap::add_point(const PointType &point, bool downsample_on) {
+    VoxelKey key = key_of(point, resolution);
+    if (downsample_on && downsample_size > 0) {
+        // like the ikd-Tree, keep only the point closest to the center of each downsample box. The box can
+        // straddle several voxels, so every voxel it overlaps is checked for a point already inside it
+        VoxelKey cell = key_of(point, downsample_size);
+        PointType mid_point;
+        mid_point.x = (cell.x + 0.5f) * downsample_size;
+        mid_point.y = (cell.y + 0.5f) * downsample_size;
+        mid_point.z = (cell.z + 0.5f) * downsample_size;
+        auto sq_dist = [&mid_point](const PointType &p) {
+            return (p.x - mid_point.x) * (p.x - mid_point.x) + (p.y - mid_point.y) * (p.y - mid_point.y) +
+                   (p.z - mid_point.z) * (p.z - mid_point.z);
+        };
+        PointType cell_min, cell_max;
+        cell_min.x = cell.x * downsample_size;
+        cell_min.y = cell.y * downsample_size;
+        cell_min.z = cell.z * downsample_size;
+        cell_max.x = (cell.x + 1) * downsample_size;
+        cell_max.y = (cell.y + 1) * downsample_size;
+        cell_max.z = (cell.z + 1) * downsample_size;
+        VoxelKey lo = key_of(cell_min, resolution), hi = key_of(cell_max, resolution);
+        for (int x = lo.x; x <= hi.x; x++)
+            for (int y = lo.y; y <= hi.y; y++)
+                for (int z = lo.z; z <= hi.z; z++) {
+                    auto found = voxels.find({x, y, z});
+                    if (found == voxels.end()) continue;
+                    PointVector &bucket = found->second->second;
+                    for (size_t i = 0; i < bucket.size(); i++) {
+                        if (!(key_of(bucket[i], downsample_size) == cell)) continue;
+                        if (sq_dist(point) >= sq_dist(bucket[i])) return false;
+                        if (found->first == key) {
+                            bucket[i] = point;
+                            voxel_list.splice(voxel_list.begin(), voxel_list, found->second);
+                            return false;
+                        }
+                        // the closer point lives in another voxel, move it there
+                        bucket[i] = bucket.back();
+                        bucket.pop_back();
+                        if (bucket.empty()) {
+                            voxel_list.erase(found->second);
+                            voxels.erase(found);
+                        }
+                        point_num--;
+                        insert_point(key, point);
+                        return false;
+                    }
+                }
+    }
+    insert_point(key, point);
+    return true;
+}
+
+void VoxelHashMap::insert_point(const VoxelKey &key, const PointType &point) {
+    auto iter = voxels.find(key);
+    if (iter == voxels.end()) {
+        voxel_list.emplace_front(key, PointVector());
+        voxels.emplace(key, voxel_list.begin());
+        while (voxels.size() > capacity) {
+            point_num -= voxel_list.back().second.size();
+            voxels.erase(voxel_list.back().first);
+            voxel_list.pop_back();
+        }
+        iter = voxels.find(key);
+    } else {
+        voxel_list.splice(voxel_list.begin(), voxel_list, iter->second);
+    }
+    iter->second->second.push_back(point);
+    point_num++;
+}
+
+int VoxelHashMap::Delete_Point_Boxes(vector<BoxPointType> &boxes) {
+    int deleted = 0;
+    auto inside = [&boxes](const PointType &p) {
+        for (const BoxPointType &box : boxes) {
+            if (box_contains(box, p)) return true;
+        }
+        return false;
+    };
+    // removes the points inside any of the boxes from one voxel, returns the iterator past it
+    auto filter = [&](VoxelList::iterator iter) {
+        PointVector &bucket = iter->second;
+        size_t kept = 0;
+        for (size_t i = 0; i < bucket.size(); i++) {
+            if (!inside(bucket[i])) bucket[kept++] = bucket[i];
+        }
+        deleted += bucket.size() - kept;
+        bucket.resize(kept);
+        if (!bucket.empty()) return std::next(iter);
+        voxels.erase(iter->first);
+        return voxel_list.erase(iter);
+    };
+    for (const BoxPointType &box : boxes) {
+        PointType box_min, box_max;
+        box_min.x = box.vertex_min[0];
+        box_min.y = box.vertex_min[1];
+        box_min.z = box.vertex_min[2];
+        box_max.x = box.vertex_max[0];
+        box_max.y = box.vertex_max[1];
+        box_max.z = box.vertex_max[2];
+        VoxelKey lo = key_of(box_min, resolution), hi = key_of(box_max, resolution);
+        double covered = double(hi.x - lo.x + 1) * (hi.y - lo.y + 1) * (hi.z - lo.z + 1);
+        if (covered > voxels.size()) {
+            // the box covers more keys than there are voxels, one pass over the map handles every box
+            for (auto iter = voxel_list.begin(); iter != voxel_list.end();) iter = filter(iter);
+            break;
+        }
+        for (int x = lo.x; x <= hi.x; x++)
+            for (int y = lo.y; y <= hi.y; y++)
+                for (int z = lo.z; z <= hi.z; z++) {
+                    auto found = voxels.find({x, y, z});
+                    if (found != voxels.end()) filter(found->second);
+                }
+    }
+    point_num -= deleted;
+    return deleted;
+}
+
+void VoxelHashMap::knn_search(const PointType &point, int k_nearest, double max_dist, PointVector &near_points,
+                              vector<float> &near_dist) const {
+    near_points.clear();
+    near_dist.clear();
+    VoxelKey center = key_of(point, resolution);
+    for (const VoxelKey &offset : nearby_offsets) {
+        auto iter = voxels.find({center.x + offset.x, center.y + offset.y, center.z + offset.z});
+        if (iter == voxels.end()) continue;
+        for (const PointType &candidate : iter->second->second) {
+            float dist = (candidate.x - point.x) * (candidate.x - point.x) +
+                         (candidate.y - point.y) * (candidate.y - point.y) +
+                         (candidate.z - point.z) * (candidate.z - point.z);
+            if (dist > max_dist) continue;
+            if (int(near_dist.size()) == k_nearest) {
+                if (dist >= near_dist.back()) continue;
+                near_points.pop_back();
+                near_dist.pop_back();
+            }
+            // insertion into the short sorted list
+            int pos = near_dist.size();
+            while (pos > 0 && near_dist[pos - 1] > dist) pos--;
+            near_dist.insert(near_dist.begin() + pos, dist);
+            near_points.insert(near_points.begin() + pos, candidate);
+        }
+    }
+}
+
+void VoxelHashMap::Nearest_Search_Batch(const PointVector &points, int k_nearest, vector<PointVector> &Nearest_Points,
+                                        vector<vector<float>> &Point_Distance, double max_dist) {
+    int query_num = points.size();
+    Nearest_Points.resize(query_num);
+    Point_Distance.resize(query_num);
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel for
+    #endif
+    for (int i = 0; i < query_num; i++)
+        knn_search(points[i], k_nearest, max_dist, Nearest_Points[i], Point_Distance[i]);
+}
+
+/* Squared distances from the query to n points in SoA layout, n a multiple of 8 */
+typedef void (*LeafDistFunc)(const float *x, const float *y, const float *z, int n, float qx, float qy, float qz,
+                             float *dist);
+
+static void leaf_dist_scalar(const float *x, const float *y, const float *z, int n, float qx, float qy, float qz,
+                             float *dist) {
+    for (int i = 0; i < n; i++) {
+        float dx = x[i] - qx, dy = y[i] - qy, dz = z[i] - qz;
+        dist[i] = dx * dx + dy * dy + dz * dz;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void leaf_dist_avx2(const float *x, const float *y, const float *z, int n, float qx, float qy, float qz,
+                           float *dist) {
+    __m256 vqx = _mm256_set1_ps(qx), vqy = _mm256_set1_ps(qy), vqz = _mm256_set1_ps(qz);
+    for (int i = 0; i < n; i += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), vqx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), vqy);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), vqz);
+        __m256 d = _mm256_mul_ps(dx, dx);
+        d = _mm256_fmadd_ps(dy, dy, d);
+        d = _mm256_fmadd_ps(dz, dz, d);
+        _mm256_storeu_ps(dist + i, d);
+    }
+}
+#elif defined(__ARM_NEON)
+static void leaf_dist_neon(const float *x, const float *y, const float *z, int n, float qx, float qy, float qz,
+                           float *dist) {
+    float32x4_t vqx = vdupq_n_f32(qx), vqy = vdupq_n_f32(qy), vqz = vdupq_n_f32(qz);
+    for (int i = 0; i < n; i += 4) {
+        float32x4_t dx = vsubq_f32(vld1q_f32(x + i), vqx);
+        float32x4_t dy = vsubq_f32(vld1q_f32(y + i), vqy);
+        float32x4_t dz = vsubq_f32(vld1q_f32(z + i), vqz);
+        float32x4_t d = vmulq_f32(dx, dx);
+        d = vmlaq_f32(d, dy, dy);
+        d = vmlaq_f32(d, dz, dz);
+        vst1q_f32(dist + i, d);
+    }
+}
+#endif
+
+static LeafDistFunc select_leaf_dist() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return leaf_dist_avx2;
+#elif defined(__ARM_NEON)
+    return leaf_dist_neon;
+#endif
+    return leaf_dist_scalar;
+}
+
+static const LeafDistFunc leaf_dist = select_leaf_dist();
+
+static inline float axis_value(const PointType &point, int axis) {
+    return axis == 0 ? point.x : (axis == 1 ? point.y : point.z);
+}
+
+BucketKdTreeMap::BucketKdTreeMap(float downsample_size, int leaf_size)
+    : downsample_size(downsample_size), leaf_size(leaf_size)
+{
+    if (leaf_size < 8 || leaf_size > MAX_LEAF_SIZE) {
+        this->leaf_size = max(8, min(MAX_LEAF_SIZE, leaf_size));
+        printf("[bucket] Leaf size %d out of [8, %d], using %d.\n", leaf_size, MAX_LEAF_SIZE, this->leaf_size);
+    }
+}
+
+int BucketKdTreeMap::new_node() {
+    int idx;
+    if (!free_nodes.empty()) {
+        idx = free_nodes.back();
+        free_nodes.pop_back();
+    } else {
+        idx = nodes.size();
+        nodes.emplace_back();
+    }
+    Node &node = nodes[idx];
+    for (int i = 0; i < 3; i++) {
+        node.box_min[i] = INFINITY;
+        node.box_max[i] = -INFINITY;
+    }
+    node.size = node.axis = 0;
+    node.split = 0.0f;
+    node.left = node.right = node.leaf = -1;
+    return idx;
+}
+
+int BucketKdTreeMap::new_leaf() {
+    int idx;
+    if (!free_leaves.empty()) {
+        idx = free_leaves.back();
+        free_leaves.pop_back();
+    } else {
+        idx = leaves.size();
+        leaves.emplace_back();
+    }
+    Leaf &leaf = leaves[idx];
+    // the padding never passes a distance test
+    fill(leaf.x, leaf.x + MAX_LEAF_SIZE, INFINITY);
+    fill(leaf.y, leaf.y + MAX_LEAF_SIZE, INFINITY);
+    fill(leaf.z, leaf.z + MAX_LEAF_SIZE, INFINITY);
+    leaf.count = 0;
+    return idx;
+}
+
+/* Turns node_idx into the subtree of points[l, r], a leaf if they fit in one */
+void BucketKdTreeMap::build(int node_idx, PointVector &points, int l, int r) {
+    int num = r - l + 1;
+    if (num <= leaf_size) {
+        int leaf_idx = new_leaf();
+        Leaf &leaf = leaves[leaf_idx];
+        for (int i = 0; i < num; i++) {
+            leaf.points[i] = points[l + i];
+            leaf.x[i] = points[l + i].x;
+            leaf.y[i] = points[l + i].y;
+            leaf.z[i] = points[l + i].z;
+        }
+        leaf.count = num;
+        nodes[node_idx].leaf = leaf_idx;
+        nodes[node_idx].left = nodes[node_idx].right = -1;
+        update_leaf(node_idx);
+        return;
+    }
+    // split at the median of the longest dimension
+    float min_value[3] = {INFINITY, INFINITY, INFINITY}, max_value[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = l; i <= r; i++) {
+        for (int j = 0; j < 3; j++) {
+            min_value[j] = min(min_value[j], axis_value(points[i], j));
+            max_value[j] = max(max_value[j], axis_value(points[i], j));
+        }
+    }
+    int axis = 0;
+    for (int j = 1; j < 3; j++)
+        if (max_value[j] - min_value[j] > max_value[axis] - min_value[axis]) axis = j;
+    int mid = (l + r + 1) >> 1;
+    nth_element(points.begin() + l, points.begin() + mid, points.begin() + r + 1,
+                [axis](const PointType &a, const PointType &b) { return axis_value(a, axis) < axis_value(b, axis); });
+    int left = new_node(), right = new_node();
+    Node &node = nodes[node_idx];
+    node.axis = axis;
+    node.split = axis_value(points[mid], axis);
+    node.left = left;
+    node.right = right;
+    node.leaf = -1;
+    build(left, points, l, mid - 1);
+    build(right, points, mid, r);
+    update_node(node_idx);
+}
+
+void BucketKdTreeMap::update_node(int node_idx) {
+    Node &node = nodes[node_idx];
+    const Node &left = nodes[node.left], &right = nodes[node.right];
+    for (int i = 0; i < 3; i++) {
+        node.box_min[i] = min(left.box_min[i], right.box_min[i]);
+        node.box_max[i] = max(left.box_max[i], right.box_max[i]);
+    }
+    node.size = left.size + right.size;
+}
+
+void BucketKdTreeMap::update_leaf(int node_idx) {
+    Node &node = nodes[node_idx];
+    const Leaf &leaf = leaves[node.leaf];
+    for (int i = 0; i < 3; i++) {
+        node.box_min[i] = INFINITY;
+        node.box_max[i] = -INFINITY;
+    }
+    for (int i = 0; i < leaf.count; i++) {
+        node.box_min[0] = min(node.box_min[0], leaf.x[i]);
+        node.box_max[0] = max(node.box_max[0], leaf.x[i]);
+        node.box_min[1] = min(node.box_min[1], leaf.y[i]);
+        node.box_max[1] = max(node.box_max[1], leaf.y[i]);
+        node.box_min[2] = min(node.box_min[2], leaf.z[i]);
+        node.box_max[2] = max(node.box_max[2], leaf.z[i]);
+    }
+    node.size = leaf.count;
+}
+
+/* Moves the points below node_idx into points and frees its descendants and leaf, node_idx itself stays */
+void BucketKdTreeMap::collect(int node_idx, PointVector &points) {
+    Node &node = nodes[node_idx];
+    if (node.leaf >= 0) {
+        const Leaf &leaf = leaves[node.leaf];
+        points.insert(points.end(), leaf.points, leaf.points + leaf.count);
+        free_leaves.push_back(node.leaf);
+        node.leaf = -1;
+        return;
+    }
+    int left = node.left, right = node.right;
+    collect(left, points);
+    collect(right, points);
+    free_nodes.push_back(left);
+    free_nodes.push_back(right);
+    nodes[node_idx].left = nodes[node_idx].right = -1;
+}
+
+void BucketKdTreeMap::Build(PointVector points) {
+    nodes.clear();
+    leaves.clear();
+    free_nodes.clear();
+    free_leaves.clear();
+    root = -1;
+    if (points.empty()) return;
+    root = new_node();
+    build(root, points, 0, points.size() - 1);
+}
+
+void BucketKdTreeMap::get_points(PointVector &points) {
+    points.clear();
+    if (root < 0) return;
+    points.reserve(nodes[root].size);
+    vector<int> stack(1, root);
+    while (!stack.empty()) {
+        const Node &node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.leaf >= 0) {
+            const Leaf &leaf = leaves[node.leaf];
+            points.insert(points.end(), leaf.points, leaf.points + leaf.count);
+        } else {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+}
+
+void BucketKdTreeMap::insert(const PointType &point) {
+    if (root < 0) {
+        PointVector storage(1, point);
+        root = new_node();
+        build(root, storage, 0, 0);
+        return;
+    }
+    vector<int> path;
+    int node_idx = root;
+    while (true) {
+        Node &node = nodes[node_idx];
+        node.box_min[0] = min(node.box_min[0], point.x);
+        node.box_max[0] = max(node.box_max[0], point.x);
+        node.box_min[1] = min(node.box_min[1], point.y);
+        node.box_max[1] = max(node.box_max[1], point.y);
+        node.box_min[2] = min(node.box_min[2], point.z);
+        node.box_max[2] = max(node.box_max[2], point.z);
+        node.size++;
+        path.push_back(node_idx);
+        if (node.leaf >= 0) break;
+        node_idx = axis_value(point, node.axis) < node.split ? node.left : node.right;
+    }
+    Leaf &leaf = leaves[nodes[node_idx].leaf];
+    if (leaf.count < leaf_size) {
+        leaf.points[leaf.count] = point;
+        leaf.x[leaf.count] = point.x;
+        leaf.y[leaf.count] = point.y;
+        leaf.z[leaf.count] = point.z;
+        leaf.count++;
+    } else {
+        // a full leaf is split into two
+        PointVector storage;
+        collect(node_idx, storage);
+        storage.push_back(point);
+        build(node_idx, storage, 0, storage.size() - 1);
+    }
+    // rebuild the highest subtree on the path whose larger child holds more than 3/4 of its points
+    for (int idx : path) {
+        const Node &node = nodes[idx];
+        if (node.leaf >= 0 || node.size < 4 * leaf_size) break;
+        if (max(nodes[node.left].size, nodes[node.right].size) * 4 > node.size * 3) {
+            PointVector storage;
+            storage.reserve(node.size);
+            collect(idx, storage);
+            build(idx, storage, 0, storage.size() - 1);
+            break;
+        }
+    }
+}
+
+int BucketKdTreeMap::Add_Points(PointVector &points, bool downsample_on) {
+    int added = 0;
+    PointVector found;
+    for (const PointType &point : points) {
+        if (!downsample_on || downsample_size <= 0 || root < 0) {
+            insert(point);
+            added++;
+            continue;
+        }
+        // same rule as KD_TREE::Add_Points: keep the point closest to the center of the downsample box
+        BoxPointType box;
+        PointType mid_point;
+        for (int i = 0; i < 3; i++) {
+            box.vertex_min[i] = floor(axis_value(point, i) / downsample_size) * downsample_size;
+            box.vertex_max[i] = box.vertex_min[i] + downsample_size;
+        }
+        mid_point.x = box.vertex_min[0] + 0.5f * downsample_size;
+        mid_point.y = box.vertex_min[1] + 0.5f * downsample_size;
+        mid_point.z = box.vertex_min[2] + 0.5f * downsample_size;
+        auto sq_dist = [&mid_point](const PointType &p) {
+            return (p.x - mid_point.x) * (p.x - mid_point.x) + (p.y - mid_point.y) * (p.y - mid_point.y) +
+                   (p.z - mid_point.z) * (p.z - mid_point.z);
+        };
+        found.clear();
+        box_search(root, box, found);
+        PointType best = point;
+        float min_dist = sq_dist(point);
+        bool new_is_best = true;
+        for (const PointType &existing : found) {
+            float dist = sq_dist(existing);
+            if (dist < min_dist) {
+                min_dist = dist;
+                best = existing;
+                new_is_best = false;
+            }
+        }
+        if (found.size() > 1 || new_is_best) {
+            if (!found.empty()) {
+                vector<BoxPointType> boxes(1, box);
+                delete_boxes(root, boxes);
+            }
+            insert(best);
+            added++;
+        }
+    }
+    return added;
+}
+
+void BucketKdTreeMap::box_search(int node_idx, const BoxPointType &box, PointVector &found) const {
+    const Node &node = nodes[node_idx];
+    for (int i = 0; i < 3; i++)
+        if (box.vertex_max[i] <= node.box_min[i] || box.vertex_min[i] > node.box_max[i]) return;
+    if (node.leaf >= 0) {
+        const Leaf &leaf = leaves[node.leaf];
+        for (int i = 0; i < leaf.count; i++)
+            if (box_contains(box, leaf.points[i])) found.push_back(leaf.points[i]);
+        return;
+    }
+    box_search(node.left, box, found);
+    box_search(node.right, box, found);
+}
+
+int BucketKdTreeMap::Delete_Point_Boxes(vector<BoxPointType> &boxes) {
+    if (root < 0 || boxes.empty()) return 0;
+    return delete_boxes(root, boxes);
+}
+
+/* Subtrees left with no more than a leaf of points collapse into one leaf */
+int BucketKdTreeMap::delete_boxes(int node_idx, const vector<BoxPointType> &boxes) {
+    const Node &node = nodes[node_idx];
+    bool overlap = false;
+    for (const BoxPointType &box : boxes) {
+        overlap = true;
+        for (int i = 0; i < 3; i++)
+            if (box.vertex_max[i] <= node.box_min[i] || box.vertex_min[i] > node.box_max[i]) overlap = false;
+        if (overlap) break;
+    }
+    if (!overlap) return 0;
+    if (node.leaf >= 0) {
+        Leaf &leaf = leaves[node.leaf];
+        int kept = 0;
+        for (int i = 0; i < leaf.count; i++) {
+            bool inside = false;
+            for (const BoxPointType &box : boxes) {
+                if (box_contains(box, leaf.points[i])) {
+                    inside = true;
+                    break;
+                }
+            }
+            if (inside) continue;
+            leaf.points[kept] = leaf.points[i];
+            leaf.x[kept] = leaf.x[i];
+            leaf.y[kept] = leaf.y[i];
+            leaf.z[kept] = leaf.z[i];
+            kept++;
+        }
+        int deleted = leaf.count - kept;
+        fill(leaf.x + kept, leaf.x + leaf.count, INFINITY);
+        fill(leaf.y + kept, leaf.y + leaf.count, INFINITY);
+        fill(leaf.z + kept, leaf.z + leaf.count, INFINITY);
+        leaf.count = kept;
+        if (deleted > 0) update_leaf(node_idx);
+        return deleted;
+    }
+    int left = node.left, right = node.right;
+    int deleted = delete_boxes(left, boxes) + delete_boxes(right, boxes);
+    if (deleted > 0) {
+        update_node(node_idx);
+        if (nodes[node_idx].size <= leaf_size) {
+            PointVector storage;
+            collect(node_idx, storage);
+            build(node_idx, storage, 0, int(storage.size()) - 1);
+        }
+    }
+    return deleted;
+}
+
+float BucketKdTreeMap::box_dist(const Node &node, const PointType &point) const {
+    float dist = 0.0f;
+    for (int i = 0; i < 3; i++) {
+        float value = axis_value(point, i);
+        float d = max(0.0f, max(node.box_min[i] - value, value - node.box_max[i]));
+        dist += d * d;
+    }
+    return dist;
+}
+
+/* The k_nearest best so far are kept sorted in near_dist[0, near_num) with pointers into the leaves */
+void BucketKdTreeMap::knn_search(int node_idx, const PointType &point, int k_nearest, float max_dist,
+                                 const PointType **near_points, float *near_dist, int &near_num) const {
+    const Node &node = nodes[node_idx];
+    if (node.leaf >= 0) {
+        const Leaf &leaf = leaves[node.leaf];
+        float dist[MAX_LEAF_SIZE];
+        leaf_dist(leaf.x, leaf.y, leaf.z, (leaf.count + 7) & ~7, point.x, point.y, point.z, dist);
+        for (int i = 0; i < leaf.count; i++) {
+            float d = dist[i];
+            if (d > max_dist || (near_num == k_nearest && d >= near_dist[k_nearest - 1])) continue;
+            int pos = near_num < k_nearest ? near_num++ : k_nearest - 1;
+            for (; pos > 0 && near_dist[pos - 1] > d; pos--) {
+                near_dist[pos] = near_dist[pos - 1];
+                near_points[pos] = near_points[pos - 1];
+            }
+            near_dist[pos] = d;
+            near_points[pos] = &leaf.points[i];
+        }
+        return;
+    }
+    int first = node.left, second = node.right;
+    float dist_first = box_dist(nodes[first], point), dist_second = box_dist(nodes[second], point);
+    if (dist_second < dist_first) {
+        swap(first, second);
+        swap(dist_first, dist_second);
+    }
+    if (dist_first > max_dist) return;
+    if (near_num < k_nearest || dist_first < near_dist[k_nearest - 1])
+        knn_search(first, point, k_nearest, max_dist, near_points, near_dist, near_num);
+    if (dist_second <= max_dist && (near_num < k_nearest || dist_second < near_dist[k_nearest - 1]))
+        knn_search(second, point, k_nearest, max_dist, near_points, near_dist, near_num);
+}
+
+void BucketKdTreeMap::Nearest_Search_Batch(const PointVector &points, int k_nearest,
+                                           vector<PointVector> &Nearest_Points, vector<vector<float>> &Point_Distance,
+                                           double max_dist) {
+    int query_num = points.size();
+    Nearest_Points.resize(query_num);
+    Point_Distance.resize(query_num);
+    if (k_nearest <= 0) return;
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel
+    #endif
+    {
+        vector<const PointType *> near_points(k_nearest);
+        vector<float> near_dist(k_nearest);
+        #ifdef MP_EN
+            #pragma omp for
+        #endif
+        for (int i = 0; i < query_num; i++) {
+            int near_num = 0;
+            if (root >= 0)
+                knn_search(root, points[i], k_nearest, max_dist, near_points.data(), near_dist.data(), near_num);
+            Nearest_Points[i].resize(near_num);
+            Point_Distance[i].assign(near_dist.begin(), near_dist.begin() + near_num);
+            for (int j = 0; j < near_num; j++) Nearest_Points[i][j] = *near_points[j];
+        }
+    }
+}
+
+std::unique_ptr<LocalMap> create_local_map(const string &backend, float downsample_size, int ikdtree_build_threads,
+                                           int bucket_leaf_size, float ivox_resolution, int ivox_nearby_type,
+                                           size_t ivox_capacity) {
+    if (backend == "ivox")
+        return std::unique_ptr<LocalMap>(
+                new VoxelHashMap(ivox_resolution, downsample_size, ivox_nearby_type, ivox_capacity));
+    if (backend == "bucket_kdtree")
+        return std::unique_ptr<LocalMap>(new BucketKdTreeMap(downsample_size, bucket_leaf_size));
+    if (backend != "ikdtree") printf("[Map] Unknown map backend \"%s\", using ikdtree.\n", backend.c_str());
+    return std::unique_ptr<LocalMap>(new IkdTreeMap(downsample_size, ikdtree_build_threads));
+}
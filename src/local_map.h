@@ -0,0 +1,183 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <ikd-Tree/ikd_Tree.h>
+
+/*
+ * Local map used for scan matching. Build() seeds the map with the first scan or a loaded map file, searches
+ * only run while no points are being added, so backends need no internal locking between the two.
+ */
+class LocalMap
+{
+  public:
+    virtual ~LocalMap() {}
+
+    virtual bool empty() = 0;
+    /* Takes the points by value, callers with a throwaway cloud move it in */
+    virtual void Build(PointVector points) = 0;
+    /* Per query up to k_nearest points sorted by squared distance, same semantics as KD_TREE::Nearest_Search */
+    virtual void Nearest_Search_Batch(const PointVector &points, int k_nearest, vector<PointVector> &Nearest_Points,
+                                      vector<vector<float>> &Point_Distance, double max_dist) = 0;
+    virtual int Add_Points(PointVector &points, bool downsample_on) = 0;
+    virtual int Delete_Point_Boxes(vector<BoxPointType> &boxes) = 0;
+    virtual void acquire_removed_points(PointVector &removed_points) { removed_points.clear(); }
+    /* Approximate k-NN, see KD_TREE::set_approximate_search. Backends without one stay exact */
+    virtual void set_approximate_search(float /*epsilon*/, int /*max_visits*/) {}
+    /* Rebuild criteria, see KD_TREE::Set_delete_criterion_param and Set_balance_criterion_param */
+    virtual void set_rebuild_criteria(float /*delete_param*/, float /*balance_param*/) {}
+    /* Per-operation counters and latencies, false for backends that keep none. Safe from any thread */
+    virtual bool get_stats(KD_TREE_STATS & /*stats*/) { return false; }
+    virtual int size() = 0;
+    virtual int validnum() = 0;
+    /* All valid points, for saving the map */
+    virtual void get_points(PointVector &points) = 0;
+};
+
+/* The incremental k-d tree, downsampling on insert at box_length, building large subtrees on build_threads */
+class IkdTreeMap : public LocalMap
+{
+  public:
+    IkdTreeMap(float box_length, int build_threads);
+
+    bool empty() override { return tree->Root_Node == nullptr; }
+    void Build(PointVector points) override { tree->Build(std::move(points)); }
+    void Nearest_Search_Batch(const PointVector &points, int k_nearest, vector<PointVector> &Nearest_Points,
+                              vector<vector<float>> &Point_Distance, double max_dist) override;
+    int Add_Points(PointVector &points, bool downsample_on) override { return tree->Add_Points(points, downsample_on); }
+    int Delete_Point_Boxes(vector<BoxPointType> &boxes) override { return tree->Delete_Point_Boxes(boxes); }
+    void acquire_removed_points(PointVector &removed_points) override { tree->acquire_removed_points(removed_points); }
+    void set_approximate_search(float epsilon, int max_visits) override {
+        tree->set_approximate_search(epsilon, max_visits);
+    }
+    void set_rebuild_criteria(float delete_param, float balance_param) override {
+        tree->Set_delete_criterion_param(delete_param);
+        tree->Set_balance_criterion_param(balance_param);
+    }
+    bool get_stats(KD_TREE_STATS &stats) override {
+        stats = tree->get_stats();
+        return true;
+    }
+    int size() override { return tree->size(); }
+    int validnum() override { return tree->validnum(); }
+    // an unbounded radius search is a read-only flatten
+    void get_points(PointVector &points) override { tree->Radius_Search(ZeroP, INFINITY, points); }
+
+  private:
+    std::unique_ptr<KD_TREE> tree;
+};
+
+/*
+ * Hashed voxel map in the spirit of iVox: points live in per-voxel buckets of a hash map, inserts only touch
+ * the buckets their downsample box overlaps, deletes the buckets a box covers and k-NN only scans the voxel of
+ * the query and its nearby_type neighbours (0, 6, 18 or 26), so the cost per scan does not depend on the map
+ * size and there is no rebalancing. Beyond capacity voxels, the least recently updated ones are evicted.
+ */
+class VoxelHashMap : public LocalMap
+{
+  public:
+    VoxelHashMap(float resolution, float downsample_size, int nearby_type, size_t capacity);
+
+    bool empty() override { return voxels.empty(); }
+    void Build(PointVector points) override;
+    void Nearest_Search_Batch(const PointVector &points, int k_nearest, vector<PointVector> &Nearest_Points,
+                              vector<vector<float>> &Point_Distance, double max_dist) override;
+    int Add_Points(PointVector &points, bool downsample_on) override;
+    int Delete_Point_Boxes(vector<BoxPointType> &boxes) override;
+    int size() override { return point_num; }
+    int validnum() override { return point_num; }
+    void get_points(PointVector &points) override;
+
+  private:
+    struct VoxelKey
+    {
+        int x, y, z;
+        bool operator==(const VoxelKey &other) const { return x == other.x && y == other.y && z == other.z; }
+    };
+    struct VoxelKeyHash
+    {
+        size_t operator()(const VoxelKey &key) const {
+            return size_t(((int64_t(key.x) * 73856093) ^ (int64_t(key.y) * 471943) ^ (int64_t(key.z) * 83492791)) &
+                          0x7fffffffffffffff);
+        }
+    };
+    // front of the list is the most recently updated voxel
+    typedef std::list<std::pair<VoxelKey, PointVector>> VoxelList;
+
+    VoxelKey key_of(const PointType &point, float cell) const;
+    bool add_point(const PointType &point, bool downsample_on);
+    void insert_point(const VoxelKey &key, const PointType &point);
+    void knn_search(const PointType &point, int k_nearest, double max_dist, PointVector &near_points,
+                    vector<float> &near_dist) const;
+
+    float resolution, downsample_size;
+    size_t capacity;
+    vector<VoxelKey> nearby_offsets;
+    VoxelList voxel_list;
+    std::unordered_map<VoxelKey, VoxelList::iterator, VoxelKeyHash> voxels;
+    int point_num = 0;
+};
+
+/*
+ * k-d tree with bucketed leaves: a leaf keeps up to leaf_size (8 to 32) points with the coordinates in SoA
+ * arrays padded with INFINITY, so a leaf is scanned eight distances at a time with AVX2 (picked at runtime
+ * on x86) or four with NEON instead of one node per point. Adds descend to a leaf and split it when full,
+ * the highest subtree on the path that got unbalanced is rebuilt, deletes shrink the boxes on the way back
+ * up. Downsampling on insert keeps the point closest to the center of each box, like the ikd-Tree.
+ */
+class BucketKdTreeMap : public LocalMap
+{
+  public:
+    BucketKdTreeMap(float downsample_size, int leaf_size);
+
+    bool empty() override { return root < 0; }
+    void Build(PointVector points) override;
+    void Nearest_Search_Batch(const PointVector &points, int k_nearest, vector<PointVector> &Nearest_Points,
+                              vector<vector<float>> &Point_Distance, double max_dist) override;
+    int Add_Points(PointVector &points, bool downsample_on) override;
+    int Delete_Point_Boxes(vector<BoxPointType> &boxes) override;
+    int size() override { return root < 0 ? 0 : nodes[root].size; }
+    int validnum() override { return size(); }
+    void get_points(PointVector &points) override;
+
+  private:
+    static constexpr int MAX_LEAF_SIZE = 32;
+    struct Node
+    {
+        float box_min[3], box_max[3];
+        int size, axis;
+        float split;
+        int left, right, leaf;  // leaf >= 0 for leaves, children otherwise
+    };
+    struct Leaf
+    {
+        float x[MAX_LEAF_SIZE], y[MAX_LEAF_SIZE], z[MAX_LEAF_SIZE];
+        PointType points[MAX_LEAF_SIZE];
+        int count;
+    };
+
+    int new_node();
+    int new_leaf();
+    void build(int node_idx, PointVector &points, int l, int r);
+    void update_node(int node_idx);
+    void update_leaf(int node_idx);
+    void collect(int node_idx, PointVector &points);
+    void insert(const PointType &point);
+    int delete_boxes(int node_idx, const vector<BoxPointType> &boxes);
+    void box_search(int node_idx, const BoxPointType &box, PointVector &found) const;
+    float box_dist(const Node &node, const PointType &point) const;
+    void knn_search(int node_idx, const PointType &point, int k_nearest, float max_dist,
+                    const PointType **near_points, float *near_dist, int &near_num) const;
+
+    float downsample_size;
+    int leaf_size;
+    vector<Node> nodes;
+    vector<Leaf, Eigen::aligned_allocator<Leaf>> leaves;
+    vector<int> free_nodes, free_leaves;
+    int root = -1;
+};
+
+std::unique_ptr<LocalMap> create_local_map(const string &backend, float downsample_size, int ikdtree_build_threads,
+                                           int bucket_leaf_size, float ivox_resolution, int ivox_nearby_type,
+                                           size_t ivox_capacity);
@@ -0,0 +1,95 @@
+#include "map_file.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char MAP_FILE_MAGIC[8] = {'L', 'I', 'M', 'A', 'P', 0, 0, 0};
+static const uint32_t MAP_FILE_VERSION = 1;
+static_assert(sizeof(MapFileHeader) == 64, "the map file header is a fixed 64 bytes");
+
+bool save_map_file(const string &path, const PointVector &points, float downsample_size) {
+    string tmp_path = path + ".tmp";
+    FILE *fp = fopen(tmp_path.c_str(), "wb");
+    if (fp == nullptr) {
+        printf("[Map] Cannot open %s for writing.\n", tmp_path.c_str());
+        return false;
+    }
+    MapFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_FILE_MAGIC, sizeof(header.magic));
+    header.version = MAP_FILE_VERSION;
+    header.point_bytes = sizeof(MapFilePoint);
+    header.point_num = points.size();
+    header.downsample_size = downsample_size;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    // packed in blocks so that the staging buffer stays small for any map size
+    const size_t block = 65536;
+    vector<MapFilePoint> packed;
+    packed.reserve(block);
+    for (size_t begin = 0; ok && begin < points.size(); begin += block) {
+        size_t end = min(points.size(), begin + block);
+        packed.clear();
+        for (size_t i = begin; i < end; i++)
+            packed.push_back({points[i].x, points[i].y, points[i].z, points[i].intensity});
+        ok = fwrite(packed.data(), sizeof(MapFilePoint), packed.size(), fp) == packed.size();
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        printf("[Map] Failed to write %s.\n", path.c_str());
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+MappedMapFile::~MappedMapFile() {
+    close();
+}
+
+bool MappedMapFile::open(const string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(MapFileHeader)) {
+        ::close(fd);
+        printf("[Map] %s is not a map file.\n", path.c_str());
+        return false;
+    }
+    length = st.st_size;
+    addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        addr = nullptr;
+        length = 0;
+        printf("[Map] Cannot map %s.\n", path.c_str());
+        return false;
+    }
+    const MapFileHeader &head = header();
+    if (memcmp(head.magic, MAP_FILE_MAGIC, sizeof(head.magic)) != 0 || head.version != MAP_FILE_VERSION ||
+        head.point_bytes != sizeof(MapFilePoint) ||
+        head.point_num > (length - sizeof(MapFileHeader)) / sizeof(MapFilePoint)) {
+        printf("[Map] %s is not a version %u map file or is truncated.\n", path.c_str(), MAP_FILE_VERSION);
+        close();
+        return false;
+    }
+    point_num = head.point_num;
+    // the points are read once front to back by the build
+    madvise(addr, length, MADV_SEQUENTIAL);
+    return true;
+}
+
+void MappedMapFile::close() {
+    if (addr != nullptr) munmap(addr, length);
+    addr = nullptr;
+    length = point_num = 0;
+}
+
+const MapFilePoint *MappedMapFile::points() const {
+    return reinterpret_cast<const MapFilePoint *>(static_cast<const char *>(addr) + sizeof(MapFileHeader));
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <ikd-Tree/ikd_Tree.h>
+
+/*
+ * Binary local map file: a fixed 64-byte MapFileHeader followed by point_num packed MapFilePoint records in
+ * the world frame of the session that wrote it. The records are read straight from a read-only mapping of
+ * the file, so nothing is copied before the points are handed to the map build.
+ */
+struct MapFileHeader
+{
+    char magic[8];           // "LIMAP\0\0\0"
+    uint32_t version;
+    uint32_t point_bytes;    // sizeof(MapFilePoint)
+    uint64_t point_num;
+    float downsample_size;   // filter_size_map of the writing session, informative only
+    uint8_t reserved[36];
+};
+
+struct MapFilePoint
+{
+    float x, y, z, intensity;
+};
+
+/* Written to path.tmp and renamed, so an interrupted save never clobbers the previous map */
+bool save_map_file(const string &path, const PointVector &points, float downsample_size);
+
+class MappedMapFile
+{
+  public:
+    MappedMapFile() = default;
+    MappedMapFile(const MappedMapFile &) = delete;
+    MappedMapFile &operator=(const MappedMapFile &) = delete;
+    ~MappedMapFile();
+
+    bool open(const string &path);
+    void close();
+
+    const MapFileHeader &header() const { return *static_cast<const MapFileHeader *>(addr); }
+    const MapFilePoint *points() const;
+    size_t size() const { return point_num; }
+
+  private:
+    void *addr = nullptr;
+    size_t length = 0, point_num = 0;
+};
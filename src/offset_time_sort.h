@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <pcl/common/io.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+/*
+ * Copies a cloud ordered by offset time (curvature). The order comes from a stable LSD radix sort of the float
+ * bits of the offset times in three passes of 11, 11 and 10 bits over key/index pairs, passes in which all keys
+ * share the digit are skipped. The points themselves are moved once, by the final gather, instead of being
+ * swapped around by std::sort. The key/index buffers are kept between scans.
+ */
+class OffsetTimeSorter
+{
+  public:
+    typedef pcl::PointCloud<pcl::PointXYZINormal> Cloud;
+
+    void sort(const Cloud &pcl_in, Cloud &pcl_out) {
+        const int shift[3] = {0, 11, 22}, mask[3] = {0x7ff, 0x7ff, 0x3ff};
+        int point_num = pcl_in.size();
+        int hist[3][1 << 11] = {{0}};
+        for (int k = 0; k < 2; k++) {
+            keys[k].resize(point_num);
+            order[k].resize(point_num);
+        }
+
+        for (int i = 0; i < point_num; i++) {
+            uint32_t key;
+            memcpy(&key, &pcl_in.points[i].curvature, sizeof(key));
+            // flip so that the unsigned order of the bits is the order of the floats, negative ones included
+            key ^= (key & 0x80000000u) ? 0xffffffffu : 0x80000000u;
+            keys[0][i] = key;
+            order[0][i] = i;
+            for (int p = 0; p < 3; p++) hist[p][(key >> shift[p]) & mask[p]]++;
+        }
+
+        int src = 0;
+        for (int p = 0; p < 3; p++) {
+            int *h = hist[p];
+            if (point_num == 0 || h[(keys[src][0] >> shift[p]) & mask[p]] == point_num) continue;
+            for (int d = 0, sum = 0; d <= mask[p]; d++) {
+                int count = h[d];
+                h[d] = sum;
+                sum += count;
+            }
+            const std::vector<uint32_t> &keys_in = keys[src];
+            const std::vector<int> &order_in = order[src];
+            std::vector<uint32_t> &keys_out = keys[1 - src];
+            std::vector<int> &order_out = order[1 - src];
+            for (int i = 0; i < point_num; i++) {
+                int pos = h[(keys_in[i] >> shift[p]) & mask[p]]++;
+                keys_out[pos] = keys_in[i];
+                order_out[pos] = order_in[i];
+            }
+            src = 1 - src;
+        }
+        pcl::copyPointCloud(pcl_in, order[src], pcl_out);
+    }
+
+  private:
+    std::vector<uint32_t> keys[2];
+    std::vector<int> order[2];
+};
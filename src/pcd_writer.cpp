@@ -0,0 +1,183 @@
+#include "pcd_writer.h"
+#include <omp.h>
+#include <pcl/filters/voxel_grid.h>
+#include <boost/filesystem.hpp>
+#include "lio_estimator.h"
+
+/* binary layout of the FIELDS written to the header, PointType without its padding */
+struct PcdPoint
+{
+    float x, y, z, intensity;
+    float normal_x, normal_y, normal_z, curvature;
+};
+
+PcdStreamWriter::PcdStreamWriter(const string &pcd_dir, int interval, double voxel_size, double max_buffer_mb)
+    : dir(pcd_dir), interval(interval), voxel_size(voxel_size), chunk(new PointCloudXYZI())
+{
+    size_t budget = size_t(max_buffer_mb * 1024.0 * 1024.0);
+    queue_budget = budget / 2;
+    chunk_budget = budget - queue_budget;
+    boost::filesystem::create_directories(dir);
+    write_thread = std::thread(&PcdStreamWriter::write_loop, this);
+}
+
+PcdStreamWriter::~PcdStreamWriter()
+{
+    close();
+}
+
+/*
+ * Called on the estimator thread. With drop_when_full it never blocks on disk and drops the scan when the
+ * queue is over budget, otherwise it waits until the writer thread has taken enough of the queue.
+ */
+bool PcdStreamWriter::push(const StatesGroup &state, const PointCloudXYZI::ConstPtr &cloud_body, bool drop_when_full) {
+    size_t bytes = cloud_body->size() * sizeof(PointType);
+    {
+        unique_lock<mutex> lock(mtx);
+        auto full = [&] { return queued_bytes > 0 && queued_bytes + bytes > queue_budget; };
+        if (!drop_when_full) cv_space.wait(lock, [&] { return closing || !full(); });
+        if (closing) return false;
+        if (full()) {
+            scans_dropped++;
+            return false;
+        }
+        jobs.push_back(ScanJob());
+        jobs.back().state = state;
+        jobs.back().cloud_body = cloud_body;
+        queued_bytes += bytes;
+        peak_bytes = max(peak_bytes, queued_bytes + chunk_bytes);
+    }
+    cv.notify_one();
+    return true;
+}
+
+/* Writes out everything still queued, then finalizes the last file */
+void PcdStreamWriter::close() {
+    {
+        lock_guard<mutex> lock(mtx);
+        if (closing) return;
+        closing = true;
+    }
+    cv.notify_one();
+    cv_space.notify_all();
+    if (write_thread.joinable()) write_thread.join();
+    print_stats();
+}
+
+void PcdStreamWriter::write_loop() {
+    while (true) {
+        ScanJob job;
+        {
+            unique_lock<mutex> lock(mtx);
+            cv.wait(lock, [this] { return closing || !jobs.empty(); });
+            if (jobs.empty()) break;
+            job = jobs.front();
+            jobs.pop_front();
+        }
+
+        double t_start = omp_get_wtime();
+        int size = job.cloud_body->size();
+        int base = chunk->size();
+        chunk->resize(base + size);
+        for (int i = 0; i < size; i++) {
+            LioEstimator::pointBodyToWorld(job.state, &job.cloud_body->points[i], &chunk->points[base + i]);
+        }
+        job.cloud_body.reset();
+        {
+            lock_guard<mutex> lock(mtx);
+            queued_bytes -= size * sizeof(PointType);
+            chunk_bytes = chunk->size() * sizeof(PointType);
+            peak_bytes = max(peak_bytes, queued_bytes + chunk_bytes);
+        }
+        cv_space.notify_all();
+        scans_written++;
+        scans_in_file++;
+
+        if (chunk->size() * sizeof(PointType) >= chunk_budget) flush_chunk();
+        if (interval > 0 && scans_in_file >= interval) {
+            flush_chunk();
+            close_file();
+        }
+        t_busy += omp_get_wtime() - t_start;
+    }
+    flush_chunk();
+    close_file();
+}
+
+void PcdStreamWriter::flush_chunk() {
+    if (chunk->empty()) return;
+    if (voxel_size > 0) {
+        pcl::VoxelGrid<PointType> voxel_filter;
+        PointCloudXYZI::Ptr chunk_filtered(new PointCloudXYZI());
+        voxel_filter.setLeafSize(voxel_size, voxel_size, voxel_size);
+        voxel_filter.setInputCloud(chunk);
+        voxel_filter.filter(*chunk_filtered);
+        chunk = chunk_filtered;
+    }
+    if (fp == nullptr && !open_file()) {
+        chunk->clear();
+        lock_guard<mutex> lock(mtx);
+        chunk_bytes = 0;
+        return;
+    }
+
+    vector<PcdPoint> packed(chunk->size());
+    for (size_t i = 0; i < chunk->size(); i++) {
+        const PointType &p = chunk->points[i];
+        packed[i] = {p.x, p.y, p.z, p.intensity, p.normal_x, p.normal_y, p.normal_z, p.curvature};
+    }
+    fwrite(packed.data(), sizeof(PcdPoint), packed.size(), fp);
+    points_in_file += packed.size();
+    points_written += packed.size();
+    chunk->clear();
+    lock_guard<mutex> lock(mtx);
+    chunk_bytes = 0;
+}
+
+bool PcdStreamWriter::open_file() {
+    string path = interval > 0 ? dir + "/PCD" + to_string(file_index + 1) + ".pcd" : dir + "/PCD_all.pcd";
+    fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) {
+        RCLCPP_ERROR(rclcpp::get_logger("laserMapping"), "Cannot open %s for writing.", path.c_str());
+        return false;
+    }
+    file_index++;
+    points_in_file = 0;
+    write_header(0);
+    return true;
+}
+
+/* The point count is patched into the header once the file is complete */
+void PcdStreamWriter::close_file() {
+    scans_in_file = 0;
+    if (fp == nullptr) return;
+    fseek(fp, 0, SEEK_SET);
+    write_header(points_in_file);
+    fclose(fp);
+    fp = nullptr;
+    files_written++;
+    if (interval > 0)
+        cout << "current scan saved to " << dir << "/PCD" << file_index << ".pcd" << endl;
+}
+
+void PcdStreamWriter::write_header(size_t point_num) {
+    // fixed width counts keep the header length unchanged when it is rewritten
+    fprintf(fp, "# .PCD v0.7 - Point Cloud Data file format\n"
+                "VERSION 0.7\n"
+                "FIELDS x y z intensity normal_x normal_y normal_z curvature\n"
+                "SIZE 4 4 4 4 4 4 4 4\n"
+                "TYPE F F F F F F F F\n"
+                "COUNT 1 1 1 1 1 1 1 1\n"
+                "WIDTH %012zu\n"
+                "HEIGHT 1\n"
+                "VIEWPOINT 0 0 0 1 0 0 0\n"
+                "POINTS %012zu\n"
+                "DATA binary\n", point_num, point_num);
+}
+
+void PcdStreamWriter::print_stats() {
+    printf("[PCD] %zu points from %d scans written to %d file(s) in %s, writer busy %.2f s\n", points_written,
+           scans_written, files_written, dir.c_str(), t_busy);
+    printf("[PCD] peak buffer %.1f MB of %.1f MB, %d scans dropped on a full buffer\n",
+           peak_bytes / 1048576.0, (queue_budget + chunk_budget) / 1048576.0, scans_dropped);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <common_lib.h>
+
+/*
+ * Streams world-frame scans into binary PCD files from a dedicated thread. Scans are queued as body-frame
+ * cloud handles plus the pose, transformed on the writer thread and gathered in a chunk that is appended
+ * to the current file whenever it reaches half of the RAM budget. With interval > 0 a new file is started
+ * every interval scans, otherwise everything goes into PCD_all.pcd. Scans arriving while the queue holds
+ * the other half of the budget are dropped and counted instead of stalling the estimator, unless the caller
+ * asks push() to wait for room, as offline replay does.
+ */
+class PcdStreamWriter
+{
+  public:
+    PcdStreamWriter(const string &pcd_dir, int interval, double voxel_size, double max_buffer_mb);
+    ~PcdStreamWriter();
+
+    bool push(const StatesGroup &state, const PointCloudXYZI::ConstPtr &cloud_body, bool drop_when_full = true);
+    void close();
+
+  private:
+    struct ScanJob
+    {
+        StatesGroup state;
+        PointCloudXYZI::ConstPtr cloud_body;
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    void write_loop();
+    void flush_chunk();
+    bool open_file();
+    void close_file();
+    void write_header(size_t point_num);
+    void print_stats();
+
+    string dir;
+    int interval;
+    double voxel_size;
+    size_t queue_budget, chunk_budget;
+
+    std::deque<ScanJob, Eigen::aligned_allocator<ScanJob>> jobs;
+    std::mutex mtx;
+    std::condition_variable cv, cv_space;
+    std::thread write_thread;
+    bool closing = false;
+
+    PointCloudXYZI::Ptr chunk;
+    FILE *fp = nullptr;
+    int file_index = 0, scans_in_file = 0;
+    size_t points_in_file = 0;
+
+    // backpressure stats
+    size_t queued_bytes = 0, chunk_bytes = 0, peak_bytes = 0, points_written = 0;
+    int scans_written = 0, scans_dropped = 0, files_written = 0;
+    double t_busy = 0.0;
+};
@@ -1,8 +1,79 @@
+#include <omp.h>
 #include "preprocess.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define RETURN0     0x00
 #define RETURN0AND1 0x10
 
+// PointCloud2 field names of the L515, in PointCloud2Reader::Field order
+static const char *const L515_FIELDS[] = {"x", "y", "z", nullptr, nullptr, nullptr, "rgb"};
+
+static int field_size(uint8_t datatype) {
+    switch (datatype) {
+        case sensor_msgs::msg::PointField::INT8:
+        case sensor_msgs::msg::PointField::UINT8: return 1;
+        case sensor_msgs::msg::PointField::INT16:
+        case sensor_msgs::msg::PointField::UINT16: return 2;
+        case sensor_msgs::msg::PointField::INT32:
+        case sensor_msgs::msg::PointField::UINT32:
+        case sensor_msgs::msg::PointField::FLOAT32: return 4;
+        case sensor_msgs::msg::PointField::FLOAT64: return 8;
+        default: return 0;
+    }
+}
+
+bool PointCloud2Reader::bind(const sensor_msgs::msg::PointCloud2 &msg, const char *const names[FIELD_NUM],
+                             const uint8_t types[FIELD_NUM]) {
+    if (names != bound_names || types != bound_types || msg.point_step != bound_point_step || msg.fields != bound_fields) {
+        bound_fields = msg.fields;
+        bound_names = names;
+        bound_types = types;
+        bound_point_step = msg.point_step;
+        valid = true;
+        exact = types != nullptr;
+        for (int f = 0; f < FIELD_NUM; f++) {
+            offsets[f] = -1;
+            if (names[f] == nullptr) continue;
+            for (const auto &field : msg.fields) {
+                if (field.name != names[f]) continue;
+                int bytes = field_size(field.datatype);
+                if (bytes > 0 && field.offset + bytes <= msg.point_step) {
+                    offsets[f] = field.offset;
+                    datatypes[f] = field.datatype;
+                }
+                break;
+            }
+            if (offsets[f] < 0) printf("[Preprocess] No usable PointCloud2 field \"%s\", reading it as 0.\n", names[f]);
+            if (types != nullptr && (offsets[f] < 0 || datatypes[f] != types[f])) exact = false;
+        }
+        if (offsets[X] < 0 || offsets[Y] < 0 || offsets[Z] < 0) {
+            printf("[Preprocess] PointCloud2 without x, y and z, dropping the scans.\n");
+            valid = false;
+        }
+    }
+    point_num = 0;
+    if (!valid) return false;
+    if (msg.is_bigendian) {
+        printf("[Preprocess] Big-endian PointCloud2 is not supported, dropping the scan.\n");
+        return false;
+    }
+    if (msg.height > 0 && msg.data.size() < size_t(msg.height - 1) * msg.row_step + size_t(msg.width) * msg.point_step) {
+        printf("[Preprocess] PointCloud2 data shorter than its layout, dropping the scan.\n");
+        return false;
+    }
+    data = msg.data.data();
+    width = msg.width;
+    point_step = msg.point_step;
+    row_step = msg.row_step;
+    contiguous = msg.height <= 1 || row_step == width * point_step;
+    point_num = size_t(msg.width) * msg.height;
+    return true;
+}
+
 const bool time_list_cut_frame(PointType &x, PointType &y) {
     return (x.curvature < y.curvature);
 }
@@ -119,188 +190,25 @@ Preprocess::process_cut_frame_pcl2(const sensor_msgs::msg::PointCloud2::UniquePt
     pl_surf.clear();
     pl_corn.clear();
     pl_full.clear();
-    if (lidar_type == VELO) {
-        pcl::PointCloud<velodyne_ros::Point> pl_orig;
-        pcl::fromROSMsg(*msg, pl_orig);
-        int plsize = pl_orig.points.size();
-        pl_surf.reserve(plsize);
-
-        bool is_first[MAX_LINE_NUM];
-        double yaw_fp[MAX_LINE_NUM] = {0};     // yaw of first scan point
-        double omega_l = 3.61;       // scan angular velocity (deg/ms)
-        float yaw_last[MAX_LINE_NUM] = {0.0};  // yaw of last scan point
-        float time_last[MAX_LINE_NUM] = {0.0}; // last offset time
-
-        if (pl_orig.points[plsize - 1].time > 0) {
-            given_offset_time = true;
-        } else {
-            cout << "Compute offset time using constant rotation model." << endl;
-            given_offset_time = false;
-            memset(is_first, true, sizeof(is_first));
-        }
-
-        for (int i = 0; i < plsize; i++) {
-            PointType added_pt;
-            added_pt.normal_x = 0;
-            added_pt.normal_y = 0;
-            added_pt.normal_z = 0;
-            added_pt.x = pl_orig.points[i].x;
-            added_pt.y = pl_orig.points[i].y;
-            added_pt.z = pl_orig.points[i].z;
-            added_pt.intensity = pl_orig.points[i].intensity;
-            added_pt.curvature = pl_orig.points[i].time * 1000.0;  //ms
-
-            double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
-            if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
-                continue;
-
-            if (!given_offset_time) {
-                int layer = pl_orig.points[i].ring;
-                double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
-
-                if (is_first[layer]) {
-                    yaw_fp[layer] = yaw_angle;
-                    is_first[layer] = false;
-                    added_pt.curvature = 0.0;
-                    yaw_last[layer] = yaw_angle;
-                    time_last[layer] = added_pt.curvature;
-                    continue;
-                }
-                // compute offset time
-                if (yaw_angle <= yaw_fp[layer]) {
-                    added_pt.curvature = (yaw_fp[layer] - yaw_angle) / omega_l;
-                } else {
-                    added_pt.curvature = (yaw_fp[layer] - yaw_angle + 360.0) / omega_l;
-                }
-                if (added_pt.curvature < time_last[layer]) added_pt.curvature += 360.0 / omega_l;
-
-                yaw_last[layer] = yaw_angle;
-                time_last[layer] = added_pt.curvature;
-            }
-
-
-            if (i % point_filter_num == 0 && pl_orig.points[i].ring < N_SCANS) {
-                pl_surf.points.push_back(added_pt);
-            }
-        }
-    } else if (lidar_type == OUSTER) {
-        pcl::PointCloud<ouster_ros::Point> pl_orig;
-        pcl::fromROSMsg(*msg, pl_orig);
-        int plsize = pl_orig.points.size();
-        pl_surf.reserve(plsize);
-        for (int i = 0; i < plsize; i++) {
-            PointType added_pt;
-            added_pt.normal_x = 0;
-            added_pt.normal_y = 0;
-            added_pt.normal_z = 0;
-            added_pt.x = pl_orig.points[i].x;
-            added_pt.y = pl_orig.points[i].y;
-            added_pt.z = pl_orig.points[i].z;
-            added_pt.intensity = pl_orig.points[i].intensity;
-            added_pt.curvature = pl_orig.points[i].t / 1e6;  //ns to ms
-
-            double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
-            if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
-                continue;
-
-            if (i % point_filter_num == 0 && pl_orig.points[i].ring < N_SCANS) {
-                pl_surf.points.push_back(added_pt);
-            }
-        }
-    } else if(lidar_type == PANDAR) {
-        pcl::PointCloud<pandar_ros::Point> pl_orig;
-        pcl::fromROSMsg(*msg, pl_orig);
-        int plsize = pl_orig.points.size();
-        pl_surf.reserve(plsize);
-        for (int i = 0; i < plsize; i++) {
-            PointType added_pt;
-            added_pt.normal_x = 0;
-            added_pt.normal_y = 0;
-            added_pt.normal_z = 0;
-            added_pt.x = pl_orig.points[i].x;
-            added_pt.y = pl_orig.points[i].y;
-            added_pt.z = pl_orig.points[i].z;
-            added_pt.intensity = pl_orig.points[i].intensity;
-//            added_pt.curvature = (pl_orig.points[i].timestamp - msg->header.stamp.toSec()) * 1000;  //s to ms
-            added_pt.curvature = (pl_orig.points[i].timestamp - pl_orig.points[0].timestamp) * 1000;  //s to ms
-
-            double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
-            if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
-                continue;
-
-            if (i % point_filter_num == 0 && pl_orig.points[i].ring < N_SCANS) {
-                pl_surf.points.push_back(added_pt);
-            }
-        }
-    }else if(lidar_type == ROBOSENSE){
-        pcl::PointCloud<robosense_ros::Point> pl_orig;
-        pcl::fromROSMsg(*msg, pl_orig);
-        int plsize = pl_orig.points.size();
-        pl_surf.reserve(plsize);
-
-        bool is_first[MAX_LINE_NUM];
-        double yaw_fp[MAX_LINE_NUM] = {0};     // yaw of first scan point
-        double omega_l = 3.61;       // scan angular velocity (deg/ms)
-        float yaw_last[MAX_LINE_NUM] = {0.0};  // yaw of last scan point
-        float time_last[MAX_LINE_NUM] = {0.0}; // last offset time
-
-        if (pl_orig.points[plsize - 1].timestamp > 0) {
-            given_offset_time = true;
-        } else {
-            cout << "Compute offset time using constant rotation model." << endl;
-            given_offset_time = false;
-            memset(is_first, true, sizeof(is_first));
-        }
-
-        for (int i = 0; i < plsize; i++) {
-            PointType added_pt;
-            added_pt.normal_x = 0;
-            added_pt.normal_y = 0;
-            added_pt.normal_z = 0;
-            added_pt.x = pl_orig.points[i].x;
-            added_pt.y = pl_orig.points[i].y;
-            added_pt.z = pl_orig.points[i].z;
-            added_pt.intensity = pl_orig.points[i].intensity;
-            added_pt.curvature = (pl_orig.points[i].timestamp - rclcpp::Time(msg->header.stamp).seconds() + 0.1)* 1000.0;  //ms
-
-
-            double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
-            if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
-                continue;
-
-            if (!given_offset_time) {
-                int layer = pl_orig.points[i].ring;
-                double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
-
-                if (is_first[layer]) {
-                    yaw_fp[layer] = yaw_angle;
-                    is_first[layer] = false;
-                    added_pt.curvature = 0.0;
-                    yaw_last[layer] = yaw_angle;
-                    time_last[layer] = added_pt.curvature;
-                    continue;
-                }
-                // compute offset time
-                if (yaw_angle <= yaw_fp[layer]) {
-                    added_pt.curvature = (yaw_fp[layer] - yaw_angle) / omega_l;
-                } else {
-                    added_pt.curvature = (yaw_fp[layer] - yaw_angle + 360.0) / omega_l;
-                }
-                if (added_pt.curvature < time_last[layer]) added_pt.curvature += 360.0 / omega_l;
-
-                yaw_last[layer] = yaw_angle;
-                time_last[layer] = added_pt.curvature;
-            }
-
-            if (i % point_filter_num == 0 && pl_orig.points[i].ring < N_SCANS) {
-                pl_surf.points.push_back(added_pt);
-            }
-        }
-    }else{
-        cout << BOLDRED << "Wrong LiDAR Type!!!" << endl;
-        return;
+    bool decoded = false;
+    switch (lidar_type) {
+        case VELO:
+            decoded = decode<VelodyneTraits>(*msg, false);
+            break;
+        case OUSTER:
+            decoded = decode<OusterTraits>(*msg, false);
+            break;
+        case PANDAR:
+            decoded = decode<PandarTraits>(*msg, false);
+            break;
+        case ROBOSENSE:
+            decoded = decode<RobosenseTraits>(*msg, false);
+            break;
+        default:
+            cout << BOLDRED << "Wrong LiDAR Type!!!" << endl;
+            return;
     }
-
+    if (!decoded) return;
 
     sort(pl_surf.points.begin(), pl_surf.points.end(), time_list_cut_frame);
 
@@ -406,13 +314,13 @@ void Preprocess::avia_handler(const livox_ros_driver::CustomMsg::UniquePtr &msg)
             plsize--;
             for (uint i = 0; i < plsize; i++) {
                 types[i].range = pl[i].x * pl[i].x + pl[i].y * pl[i].y;
-                vx = pl[i].x - pl[i + 1].x;
-                vy = pl[i].y - pl[i + 1].y;
-                vz = pl[i].z - pl[i + 1].z;
+                double vx = pl[i].x - pl[i + 1].x;
+                double vy = pl[i].y - pl[i + 1].y;
+                double vz = pl[i].z - pl[i + 1].z;
                 types[i].dista = vx * vx + vy * vy + vz * vz;
             }
             types[plsize].range = pl[plsize].x * pl[plsize].x + pl[plsize].y * pl[plsize].y;
-            give_feature(pl, types);
+            give_feature(pl, types, pl_surf, pl_corn);
             // pl_surf += pl;
         }
         time += omp_get_wtime() - t0;
@@ -449,29 +357,32 @@ void Preprocess::l515_handler(const sensor_msgs::msg::PointCloud2::UniquePtr &ms
     pl_surf.clear();
     pl_corn.clear();
     pl_full.clear();
-    pcl::PointCloud<pcl::PointXYZRGB> pl_orig;
-    pcl::fromROSMsg(*msg, pl_orig);
-    int plsize = pl_orig.size();
+    if (!cloud_reader.bind(*msg, L515_FIELDS)) return;
+    int plsize = cloud_reader.size();
     pl_corn.reserve(plsize);
     pl_surf.reserve(plsize);
 
-    for (int i = 0; i < pl_orig.points.size(); i++) {
+    for (int i = 0; i < plsize; i++) {
 
         if (i % point_filter_num != 0) continue;
 
-        double range = pl_orig.points[i].x * pl_orig.points[i].x + pl_orig.points[i].y * pl_orig.points[i].y +
-                       pl_orig.points[i].z * pl_orig.points[i].z;
+        const uint8_t *pt = cloud_reader.point(i);
+        float x = cloud_reader.read<float>(pt, PointCloud2Reader::X);
+        float y = cloud_reader.read<float>(pt, PointCloud2Reader::Y);
+        float z = cloud_reader.read<float>(pt, PointCloud2Reader::Z);
+        double range = x * x + y * y + z * z;
 
         if (range < blind * blind) continue;
 
         Eigen::Vector3d pt_vec;
         PointType added_pt;
-        added_pt.x = pl_orig.points[i].x;
-        added_pt.y = pl_orig.points[i].y;
-        added_pt.z = pl_orig.points[i].z;
-        added_pt.normal_x = pl_orig.points[i].r;
-        added_pt.normal_y = pl_orig.points[i].g;
-        added_pt.normal_z = pl_orig.points[i].b;
+        added_pt.x = x;
+        added_pt.y = y;
+        added_pt.z = z;
+        uint32_t rgb = cloud_reader.read_packed(pt, PointCloud2Reader::RGB);
+        added_pt.normal_x = (rgb >> 16) & 0xff;
+        added_pt.normal_y = (rgb >> 8) & 0xff;
+        added_pt.normal_z = rgb & 0xff;
         added_pt.curvature = 0.0;
         pl_surf.points.push_back(added_pt);
     }
@@ -481,223 +392,276 @@ void Preprocess::oust_handler(const sensor_msgs::msg::PointCloud2::UniquePtr &ms
     pl_surf.clear();
     pl_corn.clear();
     pl_full.clear();
-    pcl::PointCloud<ouster_ros::Point> pl_orig;
-    pcl::fromROSMsg(*msg, pl_orig);
-    int plsize = pl_orig.size();
-    pl_corn.reserve(plsize);
-    pl_surf.reserve(plsize);
-    if (feature_enabled) {
-        for (int i = 0; i < N_SCANS; i++) {
-            pl_buff[i].clear();
-            pl_buff[i].reserve(plsize);
-        }
-
-        for (uint i = 0; i < plsize; i++) {
-            Eigen::Vector3d pt_vec;
-            PointType added_pt;
-            added_pt.x = pl_orig.points[i].x;
-            added_pt.y = pl_orig.points[i].y;
-            added_pt.z = pl_orig.points[i].z;
-            added_pt.intensity = pl_orig.points[i].intensity;
-            added_pt.normal_x = 0;
-            added_pt.normal_y = 0;
-            added_pt.normal_z = 0;
-
-            double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
-            if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
-                continue;
-
-            double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.3;
-            if (yaw_angle >= 180.0)
-                yaw_angle -= 360.0;
-            if (yaw_angle <= -180.0)
-                yaw_angle += 360.0;
-
-            added_pt.curvature = pl_orig.points[i].t / 1e6;
-            if (pl_orig.points[i].ring < N_SCANS) {
-                pl_buff[pl_orig.points[i].ring].push_back(added_pt);
-            }
-        }
-
-        for (int j = 0; j < N_SCANS; j++) {
-            PointCloudXYZI &pl = pl_buff[j];
-            int linesize = pl.size();
-            vector<orgtype> &types = typess[j];
-            types.clear();
-            types.resize(linesize);
-            linesize--;
-            for (uint i = 0; i < linesize; i++) {
-                types[i].range = sqrt(pl[i].x * pl[i].x + pl[i].y * pl[i].y);
-                vx = pl[i].x - pl[i + 1].x;
-                vy = pl[i].y - pl[i + 1].y;
-                vz = pl[i].z - pl[i + 1].z;
-                types[i].dista = vx * vx + vy * vy + vz * vz;
-            }
-            types[linesize].range = sqrt(pl[linesize].x * pl[linesize].x + pl[linesize].y * pl[linesize].y);
-            give_feature(pl, types);
-        }
-    } else {
-        for (int i = 0; i < pl_orig.points.size(); i++) {
-            if (i % point_filter_num != 0) continue;
-            Eigen::Vector3d pt_vec;
-            PointType added_pt;
-            added_pt.x = pl_orig.points[i].x;
-            added_pt.y = pl_orig.points[i].y;
-            added_pt.z = pl_orig.points[i].z;
-            added_pt.intensity = pl_orig.points[i].intensity;
-            added_pt.normal_x = 0;
-            added_pt.normal_y = 0;
-            added_pt.normal_z = 0;
-            added_pt.curvature = pl_orig.points[i].t / 1e6;  //ms
-
-            double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
-            if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
-                continue;
-
-            if (pl_orig.points[i].ring < N_SCANS)
-                pl_surf.points.push_back(added_pt);
-        }
-    }
+    if (decode<OusterTraits>(*msg, feature_enabled) && feature_enabled) extract_features();
 }
 
 void Preprocess::velodyne_handler(const sensor_msgs::msg::PointCloud2::UniquePtr &msg) {
     pl_surf.clear();
     pl_corn.clear();
     pl_full.clear();
+    if (decode<VelodyneTraits>(*msg, feature_enabled) && feature_enabled) extract_features();
+}
 
-    pcl::PointCloud<velodyne_ros::Point> pl_orig;
-    pcl::fromROSMsg(*msg, pl_orig);
-    int plsize = pl_orig.points.size();
-    pl_surf.reserve(plsize);
-
-    bool is_first[MAX_LINE_NUM];
-    double yaw_fp[MAX_LINE_NUM] = {0};     // yaw of first scan point
-    double omega_l = 3.61;       // scan angular velocity (deg/ms)
-    float yaw_last[MAX_LINE_NUM] = {0.0};  // yaw of last scan point
-    float time_last[MAX_LINE_NUM] = {0.0}; // last offset time
+/*
+ * atan2(y, x) in degrees of n points in SoA layout. atan on [0, 1] is a degree 11 odd polynomial, the octant
+ * is restored from |y| > |x| and the signs, so there is no branch per point and the error stays below 1e-3
+ * degrees. Scaled by 57.2957 like the yaw model always was.
+ */
+typedef void (*YawDegFunc)(const float *x, const float *y, int n, float *yaw);
+
+static const float ATAN_C[6] = {0.99997726f, -0.33262347f, 0.19354346f, -0.11643287f, 0.05265332f, -0.01172120f};
+static const float HALF_PI = 1.57079633f, PI_F = 3.14159265f, YAW_DEG = 57.2957f;
+
+static void yaw_deg_scalar(const float *x, const float *y, int n, float *yaw) {
+    for (int i = 0; i < n; i++) {
+        float ax = fabsf(x[i]), ay = fabsf(y[i]);
+        float a = min(ax, ay) / max(max(ax, ay), FLT_MIN), s = a * a;
+        float r = ATAN_C[5];
+        for (int c = 4; c >= 0; c--) r = r * s + ATAN_C[c];
+        r *= a;
+        if (ay > ax) r = HALF_PI - r;
+        if (signbit(x[i])) r = PI_F - r;
+        yaw[i] = copysignf(r, y[i]) * YAW_DEG;
+    }
+}
 
-    if (pl_orig.points[plsize - 1].time > 0) {
-        given_offset_time = true;
-    } else {
-        cout << "Compute offset time using constant rotation model." << endl;
-        given_offset_time = false;
-        memset(is_first, true, sizeof(is_first));
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void yaw_deg_avx2(const float *x, const float *y, int n, float *yaw) {
+    const __m256 sign = _mm256_set1_ps(-0.0f), tiny = _mm256_set1_ps(FLT_MIN);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i), vy = _mm256_loadu_ps(y + i);
+        __m256 ax = _mm256_andnot_ps(sign, vx), ay = _mm256_andnot_ps(sign, vy);
+        __m256 a = _mm256_div_ps(_mm256_min_ps(ax, ay), _mm256_max_ps(_mm256_max_ps(ax, ay), tiny));
+        __m256 s = _mm256_mul_ps(a, a);
+        __m256 r = _mm256_set1_ps(ATAN_C[5]);
+        for (int c = 4; c >= 0; c--) r = _mm256_fmadd_ps(r, s, _mm256_set1_ps(ATAN_C[c]));
+        r = _mm256_mul_ps(r, a);
+        r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(HALF_PI), r), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+        r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI_F), r), vx);  // picks on the sign bit of x
+        r = _mm256_or_ps(r, _mm256_and_ps(sign, vy));
+        _mm256_storeu_ps(yaw + i, _mm256_mul_ps(r, _mm256_set1_ps(YAW_DEG)));
     }
+    yaw_deg_scalar(x + i, y + i, n - i, yaw + i);
+}
+#elif defined(__ARM_NEON)
+static void yaw_deg_neon(const float *x, const float *y, int n, float *yaw) {
+    const uint32x4_t sign = vdupq_n_u32(0x80000000);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t vx = vld1q_f32(x + i), vy = vld1q_f32(y + i);
+        float32x4_t ax = vabsq_f32(vx), ay = vabsq_f32(vy);
+        float32x4_t a = vdivq_f32(vminq_f32(ax, ay), vmaxq_f32(vmaxq_f32(ax, ay), vdupq_n_f32(FLT_MIN)));
+        float32x4_t s = vmulq_f32(a, a);
+        float32x4_t r = vdupq_n_f32(ATAN_C[5]);
+        for (int c = 4; c >= 0; c--) r = vmlaq_f32(vdupq_n_f32(ATAN_C[c]), r, s);
+        r = vmulq_f32(r, a);
+        r = vbslq_f32(vcgtq_f32(ay, ax), vsubq_f32(vdupq_n_f32(HALF_PI), r), r);
+        uint32x4_t x_neg = vreinterpretq_u32_s32(vshrq_n_s32(vreinterpretq_s32_f32(vx), 31));
+        r = vbslq_f32(x_neg, vsubq_f32(vdupq_n_f32(PI_F), r), r);
+        r = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(r), vandq_u32(sign, vreinterpretq_u32_f32(vy))));
+        vst1q_f32(yaw + i, vmulq_f32(r, vdupq_n_f32(YAW_DEG)));
+    }
+    yaw_deg_scalar(x + i, y + i, n - i, yaw + i);
+}
+#endif
 
-    if (feature_enabled) {
+static YawDegFunc select_yaw_deg() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return yaw_deg_avx2;
+#elif defined(__ARM_NEON)
+    return yaw_deg_neon;
+#endif
+    return yaw_deg_scalar;
+}
+
+static const YawDegFunc yaw_deg_best = select_yaw_deg();
+
+void yaw_deg(const float *x, const float *y, int n, float *yaw) { yaw_deg_best(x, y, n, yaw); }
+
+/*
+ * Decodes the cloud into pl_surf, keeping every point_filter_num-th point, or with by_ring into pl_buff by
+ * ring for feature extraction. Points of rings beyond N_SCANS, within blind or with NaN coordinates are
+ * dropped. The branches on the mode are resolved here, once per scan, so the per-point loop of each
+ * decode_points instantiation only reads, filters and stores.
+ */
+template<typename Traits>
+bool Preprocess::decode(const sensor_msgs::msg::PointCloud2 &msg, bool by_ring) {
+    if (!cloud_reader.bind(msg, Traits::fields(), PointCloud2Reader::traits_datatypes<Traits>()) || cloud_reader.size() == 0)
+        return false;
+    int plsize = cloud_reader.size();
+    bool yaw_time = false;
+    if (Traits::yaw_time_fallback) {
+        given_offset_time = cloud_reader.read<typename Traits::Time>(cloud_reader.point(plsize - 1),
+                                                                     PointCloud2Reader::TIME) > 0;
+        if (!given_offset_time) cout << "Compute offset time using constant rotation model." << endl;
+        yaw_time = !given_offset_time;
+    }
+    double stamp = rclcpp::Time(msg.header.stamp).seconds();
+    double first_time = cloud_reader.read<typename Traits::Time>(cloud_reader.point(0), PointCloud2Reader::TIME);
+    if (by_ring) {
         for (int i = 0; i < N_SCANS; i++) {
             pl_buff[i].clear();
             pl_buff[i].reserve(plsize);
         }
+    } else {
+        pl_surf.reserve(plsize);
+    }
+    // the usual driver layout copies each field as is, other field types go through the conversion switch
+    if (cloud_reader.exact_types()) decode_points<Traits, true>(by_ring, yaw_time, stamp, first_time);
+    else decode_points<Traits, false>(by_ring, yaw_time, stamp, first_time);
+    return true;
+}
 
-        for (int i = 0; i < plsize; i++) {
-            PointType added_pt;
-            added_pt.normal_x = 0;
-            added_pt.normal_y = 0;
-            added_pt.normal_z = 0;
-            int layer = pl_orig.points[i].ring;
-            if (layer >= N_SCANS) continue;
-            added_pt.x = pl_orig.points[i].x;
-            added_pt.y = pl_orig.points[i].y;
-            added_pt.z = pl_orig.points[i].z;
-            added_pt.intensity = pl_orig.points[i].intensity;
-            added_pt.curvature = pl_orig.points[i].time * 1000.0; // unit: ms
-
-            double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
-            if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
-                continue;
-
-            if (!given_offset_time) {
-                double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
-                if (is_first[layer]) {
-                    // printf("layer: %d; is first: %d", layer, is_first[layer]);
-                    yaw_fp[layer] = yaw_angle;
-                    is_first[layer] = false;
-                    added_pt.curvature = 0.0;
-                    yaw_last[layer] = yaw_angle;
-                    time_last[layer] = added_pt.curvature;
-                    continue;
-                }
-
-                if (yaw_angle <= yaw_fp[layer]) {
-                    added_pt.curvature = (yaw_fp[layer] - yaw_angle) / omega_l;
-                } else {
-                    added_pt.curvature = (yaw_fp[layer] - yaw_angle + 360.0) / omega_l;
-                }
+template<typename Traits, bool Exact>
+void Preprocess::decode_points(bool by_ring, bool yaw_time, double stamp, double first_time) {
+    if (by_ring) {
+        if (yaw_time) decode_points<Traits, Exact, true, true>(stamp, first_time);
+        else decode_points<Traits, Exact, true, false>(stamp, first_time);
+    } else {
+        if (yaw_time) decode_points<Traits, Exact, false, true>(stamp, first_time);
+        else decode_points<Traits, Exact, false, false>(stamp, first_time);
+    }
+}
 
-                if (added_pt.curvature < time_last[layer]) added_pt.curvature += 360.0 / omega_l;
+template<typename Traits, bool Exact, bool ByRing, bool YawTime>
+void Preprocess::decode_points(double stamp, double first_time) {
+    int plsize = cloud_reader.size();
+    int ring_num = min(N_SCANS, MAX_LINE_NUM);
+    if (YawTime) {
+        yaw_pl.clear();
+        yaw_pl.reserve(plsize);
+        yaw_x.clear();
+        yaw_x.reserve(plsize);
+        yaw_y.clear();
+        yaw_y.reserve(plsize);
+        yaw_layer.clear();
+        yaw_layer.reserve(plsize);
+        yaw_index.clear();
+        yaw_index.reserve(plsize);
+    }
 
-                yaw_last[layer] = yaw_angle;
-                time_last[layer] = added_pt.curvature;
-            }
+    for (int i = 0; i < plsize; i++) {
+        // the yaw model keeps state per ring, so downsampling waits until it has seen the point
+        if (!ByRing && !YawTime && i % point_filter_num != 0) continue;
+        const uint8_t *pt = cloud_reader.point(i);
+        int layer = cloud_reader.read<typename Traits::Ring, Exact>(pt, PointCloud2Reader::RING);
+        if (layer >= ring_num) continue;
 
-            pl_buff[layer].points.push_back(added_pt);
-        }
+        PointType added_pt;
+        added_pt.normal_x = 0;
+        added_pt.normal_y = 0;
+        added_pt.normal_z = 0;
+        added_pt.x = cloud_reader.read<float, Exact>(pt, PointCloud2Reader::X);
+        added_pt.y = cloud_reader.read<float, Exact>(pt, PointCloud2Reader::Y);
+        added_pt.z = cloud_reader.read<float, Exact>(pt, PointCloud2Reader::Z);
+        added_pt.intensity = cloud_reader.read<float, Exact>(pt, PointCloud2Reader::INTENSITY);
+        added_pt.curvature =
+                Traits::offset_ms(cloud_reader.read<typename Traits::Time, Exact>(pt, PointCloud2Reader::TIME), stamp, first_time);
+
+        double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
+        if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
+            continue;
 
-        for (int j = 0; j < N_SCANS; j++) {
-            PointCloudXYZI &pl = pl_buff[j];
-            int linesize = pl.size();
-            if (linesize < 2) continue;
-            vector<orgtype> &types = typess[j];
-            types.clear();
-            types.resize(linesize);
-            linesize--;
-            for (uint i = 0; i < linesize; i++) {
-                types[i].range = sqrt(pl[i].x * pl[i].x + pl[i].y * pl[i].y);
-                vx = pl[i].x - pl[i + 1].x;
-                vy = pl[i].y - pl[i + 1].y;
-                vz = pl[i].z - pl[i + 1].z;
-                types[i].dista = vx * vx + vy * vy + vz * vz;
-            }
-            types[linesize].range = sqrt(pl[linesize].x * pl[linesize].x + pl[linesize].y * pl[linesize].y);
-            give_feature(pl, types);
+        if (YawTime) {
+            yaw_pl.push_back(added_pt);
+            yaw_x.push_back(added_pt.x);
+            yaw_y.push_back(added_pt.y);
+            yaw_layer.push_back(layer);
+            yaw_index.push_back(i);
+            continue;
         }
-    } else {
-        for (int i = 0; i < plsize; i++) {
-            PointType added_pt;
-            added_pt.normal_x = 0;
-            added_pt.normal_y = 0;
-            added_pt.normal_z = 0;
-            added_pt.x = pl_orig.points[i].x;
-            added_pt.y = pl_orig.points[i].y;
-            added_pt.z = pl_orig.points[i].z;
-            added_pt.intensity = pl_orig.points[i].intensity;
-            added_pt.curvature = pl_orig.points[i].time * 1000.0; //ms
-
-            double dist = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
-            if ( dist < blind * blind || isnan(added_pt.x) || isnan(added_pt.y) || isnan(added_pt.z))
-                continue;
 
-            if (!given_offset_time) {
-                int layer = pl_orig.points[i].ring;
-                double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
-
-                if (is_first[layer]) {
-                    yaw_fp[layer] = yaw_angle;
-                    is_first[layer] = false;
-                    added_pt.curvature = 0.0;
-                    yaw_last[layer] = yaw_angle;
-                    time_last[layer] = added_pt.curvature;
-                    continue;
-                }
+        if (ByRing) pl_buff[layer].points.push_back(added_pt);
+        else pl_surf.points.push_back(added_pt);
+    }
+    if (YawTime) yaw_time_points<ByRing>();
+}
 
-                // compute offset time
-                if (yaw_angle <= yaw_fp[layer]) {
-                    added_pt.curvature = (yaw_fp[layer] - yaw_angle) / omega_l;
-                } else {
-                    added_pt.curvature = (yaw_fp[layer] - yaw_angle + 360.0) / omega_l;
-                }
+/*
+ * Constant rotation model for scans without point time: the offset time of a point is the yaw swept since the
+ * first point of its ring. The yaw of all points gathered by decode_points is computed in one vectorized pass,
+ * then a scalar pass in scan order resolves the wrap-around of each ring and stores the points.
+ */
+template<bool ByRing>
+void Preprocess::yaw_time_points() {
+    int point_num = yaw_pl.size();
+    yaw_angle.resize(point_num);
+    yaw_deg(yaw_x.data(), yaw_y.data(), point_num, yaw_angle.data());
 
-                if (added_pt.curvature < time_last[layer]) added_pt.curvature += 360.0 / omega_l;
+    bool is_first[MAX_LINE_NUM];
+    double yaw_fp[MAX_LINE_NUM] = {0};     // yaw of first scan point
+    double omega_l = 3.61;       // scan angular velocity (deg/ms)
+    float time_last[MAX_LINE_NUM] = {0.0}; // last offset time
+    memset(is_first, true, sizeof(is_first));
+
+    for (int k = 0; k < point_num; k++) {
+        PointType &added_pt = yaw_pl[k];
+        int layer = yaw_layer[k];
+        double yaw = yaw_angle[k];
+        if (is_first[layer]) {
+            yaw_fp[layer] = yaw;
+            is_first[layer] = false;
+            time_last[layer] = 0.0;
+            continue;
+        }
+        // compute offset time
+        if (yaw <= yaw_fp[layer]) {
+            added_pt.curvature = (yaw_fp[layer] - yaw) / omega_l;
+        } else {
+            added_pt.curvature = (yaw_fp[layer] - yaw + 360.0) / omega_l;
+        }
+        if (added_pt.curvature < time_last[layer]) added_pt.curvature += 360.0 / omega_l;
+        time_last[layer] = added_pt.curvature;
+        if (!ByRing && yaw_index[k] % point_filter_num != 0) continue;
 
-                yaw_last[layer] = yaw_angle;
-                time_last[layer] = added_pt.curvature;
-            }
+        if (ByRing) pl_buff[layer].points.push_back(added_pt);
+        else pl_surf.points.push_back(added_pt);
+    }
+}
 
-            if (i % point_filter_num == 0) {
-                pl_surf.points.push_back(added_pt);
-            }
+/*
+ * Splits every ring of pl_buff into surface and corner points. Rings are independent, so they are processed in
+ * parallel into ring_surf/ring_corn and appended in ring order, which keeps the output of the sequential loop.
+ */
+void Preprocess::extract_features() {
+    #ifdef MP_EN
+        omp_set_num_threads(MP_PROC_NUM);
+        #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int j = 0; j < N_SCANS; j++) {
+        PointCloudXYZI &pl = pl_buff[j];
+        ring_surf[j].clear();
+        ring_corn[j].clear();
+        int linesize = pl.size();
+        if (linesize < 2) continue;
+        vector<orgtype> &types = typess[j];
+        types.clear();
+        types.resize(linesize);
+        linesize--;
+        for (uint i = 0; i < linesize; i++) {
+            types[i].range = sqrt(pl[i].x * pl[i].x + pl[i].y * pl[i].y);
+            double vx = pl[i].x - pl[i + 1].x;
+            double vy = pl[i].y - pl[i + 1].y;
+            double vz = pl[i].z - pl[i + 1].z;
+            types[i].dista = vx * vx + vy * vy + vz * vz;
         }
+        types[linesize].range = sqrt(pl[linesize].x * pl[linesize].x + pl[linesize].y * pl[linesize].y);
+        give_feature(pl, types, ring_surf[j], ring_corn[j]);
+    }
+
+    size_t surf_num = pl_surf.size(), corn_num = pl_corn.size();
+    for (int j = 0; j < N_SCANS; j++) {
+        surf_num += ring_surf[j].size();
+        corn_num += ring_corn[j].size();
+    }
+    pl_surf.reserve(surf_num);
+    pl_corn.reserve(corn_num);
+    for (int j = 0; j < N_SCANS; j++) {
+        pl_surf.points.insert(pl_surf.points.end(), ring_surf[j].points.begin(), ring_surf[j].points.end());
+        pl_corn.points.insert(pl_corn.points.end(), ring_corn[j].points.begin(), ring_corn[j].points.end());
     }
 }
 
@@ -714,7 +678,8 @@ void Preprocess::velodyne_handler_kitti(const sensor_msgs::msg::PointCloud2::Uni
     }
 }
 
-void Preprocess::give_feature(pcl::PointCloud<PointType> &pl, vector<orgtype> &types) {
+void Preprocess::give_feature(pcl::PointCloud<PointType> &pl, vector<orgtype> &types, PointCloudXYZI &surf,
+                              PointCloudXYZI &corn) {
     int plsize = pl.size();
     int plsize2;
     if (plsize == 0) {
@@ -939,13 +904,13 @@ void Preprocess::give_feature(pcl::PointCloud<PointType> &pl, vector<orgtype> &t
                 ap.y = pl[j].y;
                 ap.z = pl[j].z;
                 ap.curvature = pl[j].curvature;
-                pl_surf.push_back(ap);
+                surf.push_back(ap);
 
                 last_surface = -1;
             }
         } else {
             if (types[j].ftype == Edge_Jump || types[j].ftype == Edge_Plane) {
-                pl_corn.push_back(pl[j]);
+                corn.push_back(pl[j]);
             }
             if (last_surface != -1) {
                 PointType ap;
@@ -959,7 +924,7 @@ void Preprocess::give_feature(pcl::PointCloud<PointType> &pl, vector<orgtype> &t
                 ap.y /= (j - last_surface);
                 ap.z /= (j - last_surface);
                 ap.curvature /= (j - last_surface);
-                pl_surf.push_back(ap);
+                surf.push_back(ap);
             }
             last_surface = -1;
         }
@@ -981,7 +946,7 @@ int Preprocess::plane_judge(const PointCloudXYZI &pl, vector<orgtype> &types, ui
     group_dis = group_dis * group_dis;
     // i_nex = i_cur;
 
-    double two_dis;
+    double two_dis, vx = 0.0, vy = 0.0, vz = 0.0;
     vector<double> disarr;
     disarr.reserve(20);
 
@@ -26,94 +26,164 @@ struct orgtype
   orgtype()
   {
     range = 0;
+    dista = 0;
+    angle[Prev] = angle[Next] = 0;
     edj[Prev] = Nr_nor;
     edj[Next] = Nr_nor;
     ftype = Nor;
     intersect = 2;
   }
 };
-namespace velodyne_ros {
-    struct EIGEN_ALIGN16 Point {
-        PCL_ADD_POINT4D;
-        float intensity;
-        float time;
-        uint16_t ring;
-        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-    };
-}  // namespace velodyne_ros
-POINT_CLOUD_REGISTER_POINT_STRUCT(velodyne_ros::Point,
-        (float, x, x)
-        (float, y, y)
-        (float, z, z)
-        (float, intensity, intensity)
-        (float, time, time)
-        (uint16_t, ring, ring)
-)
-
-namespace ouster_ros {
-  struct EIGEN_ALIGN16 Point {
-      PCL_ADD_POINT4D;
-      float intensity;
-      uint32_t t;
-      uint16_t reflectivity;
-      uint16_t  ring;
-      uint16_t ambient;
-      uint32_t range;
-      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-  };
-}  // namespace ouster_ros
-POINT_CLOUD_REGISTER_POINT_STRUCT(ouster_ros::Point,
-    (float, x, x)
-    (float, y, y)
-    (float, z, z)
-    (float, intensity, intensity)
-    // use std::uint32_t to avoid conflicting with pcl::uint32_t
-    (std::uint32_t, t, t)
-    (std::uint16_t, reflectivity, reflectivity)
-    (std::uint16_t, ring, ring)
-    (std::uint16_t, ambient, ambient)
-    (std::uint32_t, range, range)
-)
-// namespace pandar_ros
-namespace pandar_ros {
-    struct EIGEN_ALIGN16 Point {
-        PCL_ADD_POINT4D;
-        float intensity;
-        double timestamp;
-        uint16_t  ring;
-        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-    };
-}
-POINT_CLOUD_REGISTER_POINT_STRUCT(pandar_ros::Point,
-                                  (float, x, x)
-                                          (float, y, y)
-                                          (float, z, z)
-                                          (float, intensity, intensity)
-                                          (double, timestamp, timestamp)
-                                          (std::uint16_t, ring, ring)
-)
-
-//ANCHOR robosense modify
-namespace robosense_ros {
-    struct EIGEN_ALIGN16 Point {
-        PCL_ADD_POINT4D;
-        std::uint8_t intensity;
-        std::uint16_t ring;
-        double timestamp;
-        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-    };
-}
-
-// namespace robosense_ros
-POINT_CLOUD_REGISTER_POINT_STRUCT(robosense_ros::Point,
-                                  (float, x, x)
-                                          (float, y, y)
-                                          (float, z, z)
-                                          // use std::uint32_t to avoid conflicting with pcl::uint32_t
-                                          (std::uint8_t, intensity, intensity)
-                                          (std::uint16_t, ring, ring)
-                                          (double, timestamp, timestamp)
-)
+
+/*
+ * Sensor traits for Preprocess::decode: the PointCloud2 field names of the driver in PointCloud2Reader::Field
+ * order, the C++ types its time and ring fields are published as, and how the time field becomes the offset
+ * time of the point in ms, given the header stamp in s and the time field of the first point.
+ * yaw_time_fallback sensors derive the offset time from the yaw angle when the driver leaves it at 0.
+ */
+struct VelodyneTraits
+{
+  typedef float Time;
+  typedef uint16_t Ring;
+  static const bool yaw_time_fallback = true;
+  static const char *const *fields() {
+    static const char *const names[] = {"x", "y", "z", "intensity", "time", "ring", nullptr};
+    return names;
+  }
+  static double offset_ms(double time, double stamp, double first_time) { return time * 1000.0; }
+};
+
+struct OusterTraits
+{
+  typedef uint32_t Time;  // ns
+  typedef uint16_t Ring;
+  static const bool yaw_time_fallback = false;
+  static const char *const *fields() {
+    static const char *const names[] = {"x", "y", "z", "intensity", "t", "ring", nullptr};
+    return names;
+  }
+  static double offset_ms(double time, double stamp, double first_time) { return time / 1e6; }
+};
+
+struct PandarTraits
+{
+  typedef double Time;  // absolute, s
+  typedef uint16_t Ring;
+  static const bool yaw_time_fallback = false;
+  static const char *const *fields() {
+    static const char *const names[] = {"x", "y", "z", "intensity", "timestamp", "ring", nullptr};
+    return names;
+  }
+  static double offset_ms(double time, double stamp, double first_time) { return (time - first_time) * 1000; }
+};
+
+struct RobosenseTraits
+{
+  typedef double Time;  // absolute, s
+  typedef uint16_t Ring;
+  static const bool yaw_time_fallback = true;
+  static const char *const *fields() {
+    static const char *const names[] = {"x", "y", "z", "intensity", "timestamp", "ring", nullptr};
+    return names;
+  }
+  static double offset_ms(double time, double stamp, double first_time) { return (time - stamp + 0.1) * 1000.0; }
+};
+
+/* PointField datatype of a C++ field type */
+template<typename T> struct PointFieldType;
+template<> struct PointFieldType<float>    { static const uint8_t value = sensor_msgs::msg::PointField::FLOAT32; };
+template<> struct PointFieldType<double>   { static const uint8_t value = sensor_msgs::msg::PointField::FLOAT64; };
+template<> struct PointFieldType<uint8_t>  { static const uint8_t value = sensor_msgs::msg::PointField::UINT8; };
+template<> struct PointFieldType<int8_t>   { static const uint8_t value = sensor_msgs::msg::PointField::INT8; };
+template<> struct PointFieldType<uint16_t> { static const uint8_t value = sensor_msgs::msg::PointField::UINT16; };
+template<> struct PointFieldType<int16_t>  { static const uint8_t value = sensor_msgs::msg::PointField::INT16; };
+template<> struct PointFieldType<uint32_t> { static const uint8_t value = sensor_msgs::msg::PointField::UINT32; };
+template<> struct PointFieldType<int32_t>  { static const uint8_t value = sensor_msgs::msg::PointField::INT32; };
+
+/*
+ * Reads points straight out of the data buffer of a PointCloud2 by field offset, so the handlers fill the
+ * output cloud in one pass instead of going through pcl::fromROSMsg and an intermediate driver cloud. The
+ * layout is looked up again only when the fields of the incoming clouds change, normally once per topic.
+ * Fields missing from the cloud read as 0, like fromROSMsg leaves them.
+ */
+class PointCloud2Reader
+{
+  public:
+    enum Field {X, Y, Z, INTENSITY, TIME, RING, RGB, FIELD_NUM};
+
+    /*
+     * names holds the field name of each Field, nullptr for fields the caller does not read. If types is given,
+     * it holds the datatype the caller reads each named field as, and exact_types() tells whether the cloud
+     * has all of them with exactly that type.
+     */
+    bool bind(const sensor_msgs::msg::PointCloud2 &msg, const char *const names[FIELD_NUM],
+              const uint8_t types[FIELD_NUM] = nullptr);
+    size_t size() const { return point_num; }
+    const uint8_t *point(size_t i) const {
+      return contiguous ? data + i * point_step : data + (i / width) * row_step + (i % width) * point_step;
+    }
+    bool has(Field f) const { return offsets[f] >= 0; }
+    bool exact_types() const { return exact; }
+
+    /* Datatypes of the Fields of sensor traits: float x, y, z and intensity, time and ring as typedef'd */
+    template<typename Traits>
+    static const uint8_t *traits_datatypes() {
+      static const uint8_t types[FIELD_NUM] = {
+          PointFieldType<float>::value, PointFieldType<float>::value, PointFieldType<float>::value,
+          PointFieldType<float>::value, PointFieldType<typename Traits::Time>::value,
+          PointFieldType<typename Traits::Ring>::value, 0};
+      return types;
+    }
+
+    /*
+     * Value of field f converted to T. Exact skips the datatype switch and copies the field as a T, only valid
+     * while exact_types() holds and T is the type bound for f.
+     */
+    template<typename T, bool Exact = false>
+    T read(const uint8_t *pt, Field f) const {
+      if (Exact) return load<T>(pt + offsets[f]);
+      if (offsets[f] < 0) return T(0);
+      const uint8_t *p = pt + offsets[f];
+      switch (datatypes[f]) {
+        case sensor_msgs::msg::PointField::FLOAT32: return T(load<float>(p));
+        case sensor_msgs::msg::PointField::FLOAT64: return T(load<double>(p));
+        case sensor_msgs::msg::PointField::UINT8:   return T(*p);
+        case sensor_msgs::msg::PointField::INT8:    return T(int8_t(*p));
+        case sensor_msgs::msg::PointField::UINT16:  return T(load<uint16_t>(p));
+        case sensor_msgs::msg::PointField::INT16:   return T(load<int16_t>(p));
+        case sensor_msgs::msg::PointField::UINT32:  return T(load<uint32_t>(p));
+        case sensor_msgs::msg::PointField::INT32:   return T(load<int32_t>(p));
+        default: return T(0);
+      }
+    }
+    /* Bits of a packed 4-byte field such as rgb, whatever its declared type */
+    uint32_t read_packed(const uint8_t *pt, Field f) const {
+      return offsets[f] < 0 ? 0 : load<uint32_t>(pt + offsets[f]);
+    }
+
+  private:
+    template<typename T>
+    static T load(const uint8_t *p) {
+      T v;
+      memcpy(&v, p, sizeof(T));
+      return v;
+    }
+
+    vector<sensor_msgs::msg::PointField> bound_fields;
+    const char *const *bound_names = nullptr;
+    const uint8_t *bound_types = nullptr;
+    uint32_t bound_point_step = 0;
+    bool valid = false, exact = false;
+    int offsets[FIELD_NUM];
+    uint8_t datatypes[FIELD_NUM];
+
+    const uint8_t *data = nullptr;
+    size_t point_num = 0, width = 0, point_step = 0, row_step = 0;
+    bool contiguous = true;
+};
+
+/* atan2(y, x) * 57.2957 of n points in SoA layout, vectorized where the CPU allows, within 1e-3 degrees */
+void yaw_deg(const float *x, const float *y, int n, float *yaw);
 
 class Preprocess
 {
@@ -148,12 +218,22 @@ class Preprocess
   void velodyne_handler(const sensor_msgs::msg::PointCloud2::UniquePtr &msg);
   void velodyne_handler_kitti(const sensor_msgs::msg::PointCloud2::UniquePtr &msg);
   void l515_handler(const sensor_msgs::msg::PointCloud2::UniquePtr &msg);
-  void give_feature(PointCloudXYZI &pl, vector<orgtype> &types);
+  template<typename Traits>
+  bool decode(const sensor_msgs::msg::PointCloud2 &msg, bool by_ring);
+  template<typename Traits, bool Exact>
+  void decode_points(bool by_ring, bool yaw_time, double stamp, double first_time);
+  template<typename Traits, bool Exact, bool ByRing, bool YawTime>
+  void decode_points(double stamp, double first_time);
+  template<bool ByRing>
+  void yaw_time_points();
+  void extract_features();
+  void give_feature(PointCloudXYZI &pl, vector<orgtype> &types, PointCloudXYZI &surf, PointCloudXYZI &corn);
   void pub_func(PointCloudXYZI &pl, const rclcpp::Time &ct);
   int  plane_judge(const PointCloudXYZI &pl, vector<orgtype> &types, uint i, uint &i_nex, Eigen::Vector3d &curr_direct);
   bool small_plane(const PointCloudXYZI &pl, vector<orgtype> &types, uint i_cur, uint &i_nex, Eigen::Vector3d &curr_direct);
   bool edge_jump_judge(const PointCloudXYZI &pl, vector<orgtype> &types, uint i, Surround nor_dir);
   
+  PointCloud2Reader cloud_reader;
   int group_size;
   double disA, disB, inf_bound;
   double limit_maxmid, limit_midmin, limit_maxmin;
@@ -162,5 +242,9 @@ class Preprocess
   double cos160;
   double edgea, edgeb;
   double smallp_intersect, smallp_ratio;
-  double vx, vy, vz;
+  PointCloudXYZI ring_surf[128], ring_corn[128]; // per-ring output of extract_features
+  // points of the scan awaiting the yaw time model, x/y also in SoA layout for the yaw pass
+  PointCloudXYZI yaw_pl;
+  vector<float> yaw_x, yaw_y, yaw_angle;
+  vector<int> yaw_layer, yaw_index;
 };
\ No newline at end of file
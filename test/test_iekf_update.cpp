@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "iekf_update.h"
+
+/*
+ * IekfInfoUpdate against the covariance form it replaced in LioEstimator::process, where the 24x24
+ * (H^T R^-1 H + P^-1) was inverted each iteration with H = [Hsub 0]:
+ *
+ *   K_1 = (H^T R^-1 H + P^-1)^-1,  K = K_1.leftCols(12) Hsub^T R^-1
+ *   dx_new = K z + dx - K Hsub dx.head(12),  P_new = (I - [K Hsub 0]) P
+ */
+namespace {
+
+const int N = 24, M = 12;
+typedef IekfInfoUpdate<N, M> Update;
+typedef Eigen::MatrixXd MatX;
+typedef Eigen::VectorXd VecX;
+
+struct Problem
+{
+    Update::MatNN P;
+    MatX Hsub;
+    VecX z;
+    Update::VecN dx;
+    double R_inv;
+};
+
+Problem random_problem(std::mt19937 &gen, int rows, bool lidar_only) {
+    std::normal_distribution<double> normal(0.0, 1.0);
+    auto randn = [&](int r, int c) -> MatX { return MatX(r, c).unaryExpr([&](double) { return normal(gen); }); };
+
+    Problem pb;
+    // SPD with a spread of scales like the state covariance: attitude/position small, extrinsics and biases larger
+    MatX A = randn(N, N);
+    VecX scale(N);
+    for (int i = 0; i < N; i++) scale(i) = std::pow(10.0, -3.0 + 3.0 * (i % 6) / 5.0);
+    pb.P = scale.asDiagonal() * (A * A.transpose() / N + 0.1 * MatX::Identity(N, N)) * scale.asDiagonal();
+    pb.Hsub = randn(rows, M);
+    // before LI_init_done the extrinsic columns of a point-to-plane row are zero
+    if (lidar_only) pb.Hsub.rightCols(6).setZero();
+    pb.z = randn(rows, 1) * 0.05;
+    pb.dx = randn(N, 1) * 0.01;
+    pb.R_inv = 1.0 / 0.001;
+    return pb;
+}
+
+void covariance_form(const Problem &pb, Update::VecN &dx_new, Update::MatNN &P_new) {
+    MatX H_T_H = MatX::Zero(N, N);
+    H_T_H.topLeftCorner(M, M) = pb.Hsub.transpose() * pb.R_inv * pb.Hsub;
+    MatX K_1 = (H_T_H + pb.P.inverse()).inverse();
+    MatX K = K_1.leftCols(M) * pb.Hsub.transpose() * pb.R_inv;
+    dx_new = K * pb.z + pb.dx - K * pb.Hsub * pb.dx.head(M);
+    MatX G = MatX::Zero(N, N);
+    G.leftCols(M) = K * pb.Hsub;
+    P_new = (MatX::Identity(N, N) - G) * pb.P;
+}
+
+void information_form(const Problem &pb, Update::VecN &dx_new, Update::MatNN &P_new) {
+    Update::MatMM H_T_H = pb.Hsub.transpose() * pb.R_inv * pb.Hsub;
+    Update::VecM H_T_R_inv_z = pb.Hsub.transpose() * pb.R_inv * pb.z;
+    Update update(pb.P);
+    Update::MatNM K_x = update.gain(H_T_H);
+    dx_new = Update::increment(K_x, H_T_H, H_T_R_inv_z, pb.dx);
+    P_new = Update::covariance(K_x, H_T_H, pb.P);
+}
+
+void expect_equivalent(const Problem &pb) {
+    Update::VecN dx_ref, dx;
+    Update::MatNN P_ref, P;
+    covariance_form(pb, dx_ref, P_ref);
+    information_form(pb, dx, P);
+    EXPECT_LE((dx - dx_ref).norm(), 1e-8 * (1.0 + dx_ref.norm()));
+    EXPECT_LE((P - P_ref).norm(), 1e-8 * P_ref.norm());
+}
+
+}  // namespace
+
+TEST(IekfInfoUpdate, MatchesCovarianceForm) {
+    std::mt19937 gen(1);
+    for (int trial = 0; trial < 50; trial++) expect_equivalent(random_problem(gen, 200 + trial * 20, false));
+}
+
+TEST(IekfInfoUpdate, MatchesCovarianceFormLidarOnly) {
+    std::mt19937 gen(2);
+    for (int trial = 0; trial < 50; trial++) expect_equivalent(random_problem(gen, 200 + trial * 20, true));
+}
+
+TEST(IekfInfoUpdate, FewMeasurements) {
+    // fewer residuals than observed states, H_T_H is rank deficient and only the prior keeps the solve regular
+    std::mt19937 gen(3);
+    for (int rows = 1; rows < M; rows++) expect_equivalent(random_problem(gen, rows, false));
+}
+
+TEST(IekfInfoUpdate, NoMeasurements) {
+    std::mt19937 gen(4);
+    Problem pb = random_problem(gen, 1, false);
+    pb.Hsub.setZero();
+    Update::VecN dx;
+    Update::MatNN P;
+    information_form(pb, dx, P);
+    EXPECT_LE((dx - pb.dx).norm(), 1e-12);
+    EXPECT_LE((P - pb.P).norm(), 1e-12 * pb.P.norm());
+}
@@ -0,0 +1,179 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <array>
+#include <random>
+#include <ikd-Tree/ikd_Tree.h>
+
+/*
+ * KD_TREE against brute force: Nearest_Search_Batch against Nearest_Search and a linear scan, the tree after
+ * box deletes and re-adds that recycle pool nodes, a parallel Build against a serial one, and searches that
+ * run while the rebuild thread swaps in rebuilt subtrees. max_dist is compared with squared distances, as
+ * in Search.
+ */
+namespace {
+
+PointVector random_points(std::mt19937 &gen, int num, float extent, float offset_x = 0.0f) {
+    std::uniform_real_distribution<float> uniform(-extent, extent);
+    PointVector points(num);
+    for (PointType &p : points) {
+        p.x = uniform(gen) + offset_x;
+        p.y = uniform(gen);
+        p.z = uniform(gen) * 0.2f;
+        p.intensity = 0.0f;
+    }
+    return points;
+}
+
+float sq_dist(const PointType &a, const PointType &b) {
+    return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+}
+
+vector<float> brute_force_knn(const PointVector &map, const PointType &query, int k_nearest, double max_dist) {
+    vector<float> dist;
+    for (const PointType &p : map) {
+        float d = sq_dist(p, query);
+        if (d <= max_dist) dist.push_back(d);
+    }
+    int num = min(int(dist.size()), k_nearest);
+    partial_sort(dist.begin(), dist.begin() + num, dist.end());
+    dist.resize(num);
+    return dist;
+}
+
+vector<std::array<float, 3>> sorted_coords(const PointVector &points) {
+    vector<std::array<float, 3>> coords;
+    for (const PointType &p : points) coords.push_back({p.x, p.y, p.z});
+    sort(coords.begin(), coords.end());
+    return coords;
+}
+
+PointVector tree_points(KD_TREE &tree) {
+    PointVector points;
+    tree.Radius_Search(PointType(), INFINITY, points);
+    return points;
+}
+
+void expect_knn_matches_brute_force(KD_TREE &tree, const PointVector &map, const PointVector &queries,
+                                    int k_nearest, double max_dist) {
+    vector<PointVector> nearest;
+    vector<vector<float>> dist;
+    tree.Nearest_Search_Batch(queries, k_nearest, nearest, dist, max_dist);
+    ASSERT_EQ(nearest.size(), queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        vector<float> expected = brute_force_knn(map, queries[i], k_nearest, max_dist);
+        ASSERT_EQ(dist[i].size(), expected.size()) << "query " << i;
+        for (size_t j = 0; j < expected.size(); j++) {
+            EXPECT_NEAR(dist[i][j], expected[j], 1e-5f) << "query " << i << ", neighbour " << j;
+            EXPECT_NEAR(sq_dist(nearest[i][j], queries[i]), dist[i][j], 1e-5f);
+        }
+    }
+}
+
+TEST(KdTree, BatchMatchesSingleSearch) {
+    std::mt19937 gen(1);
+    PointVector map = random_points(gen, 50000, 20.0f), queries = random_points(gen, 2000, 22.0f);
+    KD_TREE tree(0.5, 0.6, 0.2);
+    tree.Build(map);
+
+    vector<PointVector> nearest;
+    vector<vector<float>> dist;
+    tree.Nearest_Search_Batch(queries, 5, nearest, dist, 5.0);
+    ASSERT_EQ(nearest.size(), queries.size());
+    ASSERT_EQ(dist.size(), queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        PointVector single_nearest;
+        vector<float> single_dist;
+        tree.Nearest_Search(queries[i], 5, single_nearest, single_dist, 5.0);
+        EXPECT_EQ(dist[i], single_dist) << "query " << i;
+        EXPECT_EQ(sorted_coords(nearest[i]), sorted_coords(single_nearest)) << "query " << i;
+    }
+}
+
+TEST(KdTree, BatchMatchesBruteForce) {
+    std::mt19937 gen(2);
+    PointVector map = random_points(gen, 50000, 20.0f), queries = random_points(gen, 1000, 22.0f);
+    KD_TREE tree(0.5, 0.6, 0.2);
+    tree.Build(map);
+    expect_knn_matches_brute_force(tree, map, queries, 5, 5.0);
+    expect_knn_matches_brute_force(tree, map, queries, 1, INFINITY);
+}
+
+TEST(KdTree, DeletesAndAddsMatchBruteForce) {
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<float> uniform(-20.0f, 20.0f);
+    PointVector map = random_points(gen, 30000, 20.0f), queries = random_points(gen, 500, 20.0f);
+    KD_TREE tree(0.5, 0.6, 0.2);
+    tree.Build(map);
+    for (int round = 0; round < 10; round++) {
+        // the nodes of the deleted points go back to the pool and are handed out again by the adds
+        vector<BoxPointType> boxes(3);
+        for (BoxPointType &box : boxes) {
+            float x = uniform(gen), y = uniform(gen);
+            box.vertex_min[0] = x, box.vertex_max[0] = x + 5.0f;
+            box.vertex_min[1] = y, box.vertex_max[1] = y + 5.0f;
+            box.vertex_min[2] = -10.0f, box.vertex_max[2] = 10.0f;
+        }
+        PointVector kept;
+        for (const PointType &p : map) {
+            bool inside = false;
+            for (const BoxPointType &box : boxes)
+                inside |= p.x >= box.vertex_min[0] && p.x < box.vertex_max[0] && p.y >= box.vertex_min[1] &&
+                          p.y < box.vertex_max[1] && p.z >= box.vertex_min[2] && p.z < box.vertex_max[2];
+            if (!inside) kept.push_back(p);
+        }
+        EXPECT_EQ(tree.Delete_Point_Boxes(boxes), int(map.size() - kept.size()));
+        map = kept;
+        PointVector added = random_points(gen, 3000, 20.0f);
+        tree.Add_Points(added, false);
+        map.insert(map.end(), added.begin(), added.end());
+    }
+    EXPECT_EQ(tree.validnum(), int(map.size()));
+    EXPECT_EQ(sorted_coords(tree_points(tree)), sorted_coords(map));
+    expect_knn_matches_brute_force(tree, map, queries, 5, 5.0);
+}
+
+TEST(KdTree, ParallelBuildMatchesSerial) {
+    std::mt19937 gen(4);
+    // above Parallel_Build_Point_Num, so the top of the tree is split into subtrees built concurrently
+    PointVector map = random_points(gen, 200000, 50.0f), queries = random_points(gen, 300, 50.0f);
+    KD_TREE serial(0.5, 0.6, 0.2), parallel(0.5, 0.6, 0.2);
+    serial.Build(map);
+    parallel.set_build_threads(4);
+    parallel.Build(map);
+    EXPECT_EQ(parallel.size(), serial.size());
+    EXPECT_EQ(sorted_coords(tree_points(parallel)), sorted_coords(tree_points(serial)));
+    expect_knn_matches_brute_force(parallel, map, queries, 5, 5.0);
+}
+
+TEST(KdTree, SearchDuringRebuild) {
+    std::mt19937 gen(5);
+    PointVector map = random_points(gen, 20000, 20.0f), queries = random_points(gen, 500, 20.0f);
+    KD_TREE tree(0.5, 0.6, 0.2);
+    tree.Build(map);
+    vector<vector<float>> expected;
+    for (const PointType &q : queries) expected.push_back(brute_force_knn(map, q, 5, 5.0));
+
+    // points added far away unbalance the tree and hand subtrees to the rebuild thread, but never change the
+    // neighbours of the queries. Like in the estimator, searches and adds alternate on one thread while the
+    // rebuild thread swaps in rebuilt subtrees at any time
+    int mismatches = 0;
+    for (int batch = 0; batch < 50; batch++) {
+        PointVector added = random_points(gen, 2000, 20.0f, 1000.0f + 50.0f * batch);
+        tree.Add_Points(added, false);
+        vector<PointVector> nearest;
+        vector<vector<float>> dist;
+        tree.Nearest_Search_Batch(queries, 5, nearest, dist, 5.0);
+        for (size_t i = 0; i < queries.size(); i++) {
+            if (dist[i].size() != expected[i].size()) {
+                mismatches++;
+                continue;
+            }
+            for (size_t j = 0; j < dist[i].size(); j++)
+                if (fabs(dist[i][j] - expected[i][j]) > 1e-5f) mismatches++;
+        }
+    }
+    EXPECT_EQ(mismatches, 0);
+    EXPECT_EQ(tree.validnum(), 20000 + 50 * 2000);
+}
+
+}  // namespace
@@ -0,0 +1,216 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <array>
+#include <map>
+#include <random>
+#include "local_map.h"
+
+/*
+ * BucketKdTreeMap and VoxelHashMap against brute force over the same points: k-NN distances, the points left
+ * after Delete_Point_Boxes with the half-open boxes of the ikd-Tree, and the downsampling on insert keeping
+ * the point closest to the center of each box. max_dist is compared with squared distances, as in the tree.
+ */
+namespace {
+
+PointVector random_points(std::mt19937 &gen, int num, float extent) {
+    std::uniform_real_distribution<float> uniform(-extent, extent);
+    PointVector points(num);
+    for (PointType &p : points) {
+        p.x = uniform(gen);
+        p.y = uniform(gen);
+        p.z = uniform(gen);
+        p.intensity = 0.0f;
+    }
+    return points;
+}
+
+float sq_dist(const PointType &a, const PointType &b) {
+    return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+}
+
+vector<float> brute_force_knn(const PointVector &map, const PointType &query, int k_nearest, double max_dist) {
+    vector<float> dist;
+    for (const PointType &p : map) {
+        float d = sq_dist(p, query);
+        if (d <= max_dist) dist.push_back(d);
+    }
+    int num = min(int(dist.size()), k_nearest);
+    partial_sort(dist.begin(), dist.begin() + num, dist.end());
+    dist.resize(num);
+    return dist;
+}
+
+bool in_box(const BoxPointType &box, const PointType &p) {
+    return p.x >= box.vertex_min[0] && p.x < box.vertex_max[0] && p.y >= box.vertex_min[1] &&
+           p.y < box.vertex_max[1] && p.z >= box.vertex_min[2] && p.z < box.vertex_max[2];
+}
+
+/* Points compared by coordinates, so that two maps holding the same points compare equal */
+vector<std::array<float, 3>> sorted_coords(const PointVector &points) {
+    vector<std::array<float, 3>> coords;
+    for (const PointType &p : points) coords.push_back({p.x, p.y, p.z});
+    sort(coords.begin(), coords.end());
+    return coords;
+}
+
+void expect_knn_matches_brute_force(LocalMap &map, const PointVector &points, const PointVector &queries,
+                                    int k_nearest, double max_dist) {
+    vector<PointVector> nearest;
+    vector<vector<float>> dist;
+    map.Nearest_Search_Batch(queries, k_nearest, nearest, dist, max_dist);
+    ASSERT_EQ(nearest.size(), queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        vector<float> expected = brute_force_knn(points, queries[i], k_nearest, max_dist);
+        ASSERT_EQ(dist[i].size(), expected.size()) << "query " << i;
+        ASSERT_EQ(nearest[i].size(), expected.size()) << "query " << i;
+        for (size_t j = 0; j < expected.size(); j++) {
+            EXPECT_NEAR(dist[i][j], expected[j], 1e-5f) << "query " << i << ", neighbour " << j;
+            EXPECT_NEAR(sq_dist(nearest[i][j], queries[i]), dist[i][j], 1e-5f);
+        }
+    }
+}
+
+void expect_box_delete_matches_brute_force(LocalMap &map, const PointVector &points) {
+    vector<BoxPointType> boxes(2);
+    // each box has its max corner on a map point in one axis, so that the half-open bounds matter
+    const PointType &p0 = points[0], &p1 = points[1];
+    boxes[0].vertex_min[0] = p0.x - 3.0f, boxes[0].vertex_max[0] = p0.x;
+    boxes[0].vertex_min[1] = p0.y - 2.0f, boxes[0].vertex_max[1] = p0.y + 3.0f;
+    boxes[0].vertex_min[2] = p0.z - 4.0f, boxes[0].vertex_max[2] = p0.z + 1.0f;
+    boxes[1].vertex_min[0] = p1.x - 2.0f, boxes[1].vertex_max[0] = p1.x + 6.0f;
+    boxes[1].vertex_min[1] = p1.y - 5.0f, boxes[1].vertex_max[1] = p1.y;
+    boxes[1].vertex_min[2] = p1.z, boxes[1].vertex_max[2] = p1.z + 2.0f;
+
+    PointVector expected;
+    for (const PointType &p : points)
+        if (!in_box(boxes[0], p) && !in_box(boxes[1], p)) expected.push_back(p);
+
+    int deleted = map.Delete_Point_Boxes(boxes);
+    EXPECT_EQ(deleted, int(points.size() - expected.size()));
+    EXPECT_EQ(map.size(), int(expected.size()));
+    PointVector remaining;
+    map.get_points(remaining);
+    EXPECT_EQ(sorted_coords(remaining), sorted_coords(expected));
+}
+
+/* Every downsample box keeps a single point, the one of the inputs closest to its center */
+void expect_downsampled(LocalMap &map, const PointVector &inputs, float downsample_size) {
+    auto cell_of = [downsample_size](const PointType &p) {
+        return std::array<int, 3>{int(floor(p.x / downsample_size)), int(floor(p.y / downsample_size)),
+                                  int(floor(p.z / downsample_size))};
+    };
+    auto center_dist = [&](const PointType &p) {
+        std::array<int, 3> cell = cell_of(p);
+        PointType mid;
+        mid.x = (cell[0] + 0.5f) * downsample_size;
+        mid.y = (cell[1] + 0.5f) * downsample_size;
+        mid.z = (cell[2] + 0.5f) * downsample_size;
+        return sq_dist(p, mid);
+    };
+    std::map<std::array<int, 3>, PointType> closest;
+    for (const PointType &p : inputs) {
+        auto iter = closest.find(cell_of(p));
+        if (iter == closest.end()) closest.emplace(cell_of(p), p);
+        else if (center_dist(p) < center_dist(iter->second)) iter->second = p;
+    }
+    PointVector expected, kept;
+    for (const auto &cell : closest) expected.push_back(cell.second);
+    map.get_points(kept);
+    EXPECT_EQ(map.size(), int(expected.size()));
+    EXPECT_EQ(sorted_coords(kept), sorted_coords(expected));
+}
+
+TEST(BucketKdTreeMap, KnnMatchesBruteForce) {
+    std::mt19937 gen(1);
+    PointVector points = random_points(gen, 20000, 10.0f), queries = random_points(gen, 500, 11.0f);
+    BucketKdTreeMap map(0.0f, 16);
+    map.Build(points);
+    expect_knn_matches_brute_force(map, points, queries, 5, 4.0);
+    expect_knn_matches_brute_force(map, points, queries, 1, 1e10);
+}
+
+TEST(BucketKdTreeMap, KnnAfterAddsMatchesBruteForce) {
+    std::mt19937 gen(2);
+    PointVector points = random_points(gen, 5000, 10.0f), queries = random_points(gen, 300, 10.0f);
+    BucketKdTreeMap map(0.0f, 8);
+    map.Build(points);
+    for (int batch = 0; batch < 10; batch++) {
+        PointVector added = random_points(gen, 1000, 10.0f);
+        map.Add_Points(added, false);
+        points.insert(points.end(), added.begin(), added.end());
+    }
+    EXPECT_EQ(map.size(), int(points.size()));
+    expect_knn_matches_brute_force(map, points, queries, 5, 4.0);
+}
+
+TEST(BucketKdTreeMap, BoxDeleteMatchesBruteForce) {
+    std::mt19937 gen(3);
+    PointVector points = random_points(gen, 20000, 10.0f), queries = random_points(gen, 300, 10.0f);
+    BucketKdTreeMap map(0.0f, 16);
+    map.Build(points);
+    expect_box_delete_matches_brute_force(map, points);
+    PointVector remaining;
+    map.get_points(remaining);
+    expect_knn_matches_brute_force(map, remaining, queries, 5, 4.0);
+}
+
+TEST(BucketKdTreeMap, DownsampleKeepsClosestToCenter) {
+    std::mt19937 gen(4);
+    PointVector inputs = random_points(gen, 20000, 5.0f);
+    BucketKdTreeMap map(0.5f, 16);
+    for (size_t i = 0; i < inputs.size(); i += 1000) {
+        PointVector batch(inputs.begin() + i, inputs.begin() + min(inputs.size(), i + 1000));
+        map.Add_Points(batch, true);
+    }
+    expect_downsampled(map, inputs, 0.5f);
+}
+
+TEST(VoxelHashMap, KnnMatchesBruteForceWithinResolution) {
+    std::mt19937 gen(5);
+    PointVector points = random_points(gen, 20000, 10.0f), queries = random_points(gen, 500, 11.0f);
+    // with the 26 neighbours every point closer than the resolution is scanned, so the search is exact
+    VoxelHashMap map(1.0f, 0.0f, 26, 1000000);
+    map.Build(points);
+    expect_knn_matches_brute_force(map, points, queries, 5, 1.0);
+}
+
+TEST(VoxelHashMap, BoxDeleteMatchesBruteForce) {
+    std::mt19937 gen(6);
+    PointVector points = random_points(gen, 20000, 10.0f), queries = random_points(gen, 300, 10.0f);
+    VoxelHashMap map(1.0f, 0.0f, 26, 1000000);
+    map.Build(points);
+    expect_box_delete_matches_brute_force(map, points);
+    PointVector remaining;
+    map.get_points(remaining);
+    expect_knn_matches_brute_force(map, remaining, queries, 5, 1.0);
+}
+
+TEST(VoxelHashMap, BoxDeleteOfWholeMap) {
+    std::mt19937 gen(7);
+    PointVector points = random_points(gen, 5000, 10.0f);
+    VoxelHashMap map(0.5f, 0.0f, 26, 1000000);
+    map.Build(points);
+    // far more voxel keys than voxels, takes the pass over the whole map
+    vector<BoxPointType> boxes(1);
+    for (int i = 0; i < 3; i++) {
+        boxes[0].vertex_min[i] = -1000.0f;
+        boxes[0].vertex_max[i] = 1000.0f;
+    }
+    EXPECT_EQ(map.Delete_Point_Boxes(boxes), 5000);
+    EXPECT_TRUE(map.empty());
+    EXPECT_EQ(map.size(), 0);
+}
+
+TEST(VoxelHashMap, DownsampleAcrossVoxelBorders) {
+    std::mt19937 gen(8);
+    PointVector inputs = random_points(gen, 20000, 5.0f);
+    // downsample boxes of 0.3 straddle the 0.5 voxels
+    VoxelHashMap map(0.5f, 0.3f, 26, 1000000);
+    for (size_t i = 0; i < inputs.size(); i += 1000) {
+        PointVector batch(inputs.begin() + i, inputs.begin() + min(inputs.size(), i + 1000));
+        map.Add_Points(batch, true);
+    }
+    expect_downsampled(map, inputs, 0.3f);
+}
+
+}  // namespace
@@ -0,0 +1,82 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include "offset_time_sort.h"
+
+/*
+ * OffsetTimeSorter against std::stable_sort by curvature. The intensity of each point holds its input index,
+ * so equal offset times also have to come out in input order.
+ */
+namespace {
+
+typedef OffsetTimeSorter::Cloud Cloud;
+
+Cloud indexed_cloud(const std::vector<float> &times) {
+    Cloud cloud;
+    for (size_t i = 0; i < times.size(); i++) {
+        pcl::PointXYZINormal p;
+        p.x = p.y = p.z = 0.0f;
+        p.intensity = float(i);
+        p.curvature = times[i];
+        cloud.push_back(p);
+    }
+    return cloud;
+}
+
+void expect_stable_sorted(OffsetTimeSorter &sorter, const std::vector<float> &times) {
+    Cloud cloud = indexed_cloud(times), sorted;
+    sorter.sort(cloud, sorted);
+    Cloud expected = cloud;
+    std::stable_sort(expected.points.begin(), expected.points.end(),
+                     [](const pcl::PointXYZINormal &a, const pcl::PointXYZINormal &b) {
+                         return a.curvature < b.curvature;
+                     });
+    ASSERT_EQ(sorted.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        EXPECT_EQ(sorted.points[i].curvature, expected.points[i].curvature) << "position " << i;
+        EXPECT_EQ(sorted.points[i].intensity, expected.points[i].intensity) << "position " << i;
+    }
+}
+
+TEST(OffsetTimeSort, MatchesStableSort) {
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> offset_ms(0.0f, 100.0f);
+    std::vector<float> times(100000);
+    for (float &t : times) t = offset_ms(gen);
+    OffsetTimeSorter sorter;
+    expect_stable_sorted(sorter, times);
+}
+
+TEST(OffsetTimeSort, EqualTimesKeepInputOrder) {
+    // drivers stamp the points of one firing alike, so many times repeat
+    std::mt19937 gen(2);
+    std::uniform_int_distribution<int> firing(0, 1799);
+    std::vector<float> times(57600);
+    for (float &t : times) t = firing(gen) * (100.0f / 1800.0f);
+    OffsetTimeSorter sorter;
+    expect_stable_sorted(sorter, times);
+}
+
+TEST(OffsetTimeSort, NegativeTimes) {
+    // points stamped before the scan start, as after cutting frames
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<float> offset_ms(-50.0f, 50.0f);
+    std::vector<float> times(20000);
+    for (float &t : times) t = offset_ms(gen);
+    times[0] = 0.0f;
+    times[1] = -1e-30f;
+    times[2] = 1e-30f;
+    OffsetTimeSorter sorter;
+    expect_stable_sorted(sorter, times);
+}
+
+TEST(OffsetTimeSort, SkippedPassesAndReuse) {
+    OffsetTimeSorter sorter;
+    // all keys share every digit, so every pass is skipped
+    expect_stable_sorted(sorter, std::vector<float>(1000, 25.0f));
+    // the buffers of the previous scan are larger than this one
+    expect_stable_sorted(sorter, {3.0f, 1.0f, 2.0f, 1.0f});
+    expect_stable_sorted(sorter, {});
+}
+
+}  // namespace
@@ -0,0 +1,348 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include "preprocess.h"
+
+/*
+ * Preprocess decoding against the pcl::fromROSMsg path it replaced: for each sensor traits struct the scan is
+ * published from the driver's point type, converted back with fromROSMsg and turned into the expected cloud
+ * like the old handlers did. Also the bound of the vectorized yaw atan2, and the parallel feature extraction
+ * against extracting the rings one at a time.
+ */
+namespace velodyne_ros {
+struct EIGEN_ALIGN16 Point
+{
+    PCL_ADD_POINT4D;
+    float intensity;
+    float time;
+    uint16_t ring;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+}  // namespace velodyne_ros
+POINT_CLOUD_REGISTER_POINT_STRUCT(velodyne_ros::Point,
+    (float, x, x)
+    (float, y, y)
+    (float, z, z)
+    (float, intensity, intensity)
+    (float, time, time)
+    (uint16_t, ring, ring)
+)
+
+/* Velodyne fields with other types than VelodyneTraits reads, decoded through the conversion switch */
+namespace velodyne_wide_ros {
+struct EIGEN_ALIGN16 Point
+{
+    PCL_ADD_POINT4D;
+    float intensity;
+    double time;
+    uint8_t ring;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+}  // namespace velodyne_wide_ros
+POINT_CLOUD_REGISTER_POINT_STRUCT(velodyne_wide_ros::Point,
+    (float, x, x)
+    (float, y, y)
+    (float, z, z)
+    (float, intensity, intensity)
+    (double, time, time)
+    (std::uint8_t, ring, ring)
+)
+
+namespace ouster_ros {
+struct EIGEN_ALIGN16 Point
+{
+    PCL_ADD_POINT4D;
+    float intensity;
+    uint32_t t;
+    uint16_t reflectivity;
+    uint16_t ring;
+    uint16_t ambient;
+    uint32_t range;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+}  // namespace ouster_ros
+POINT_CLOUD_REGISTER_POINT_STRUCT(ouster_ros::Point,
+    (float, x, x)
+    (float, y, y)
+    (float, z, z)
+    (float, intensity, intensity)
+    (std::uint32_t, t, t)
+    (std::uint16_t, reflectivity, reflectivity)
+    (std::uint16_t, ring, ring)
+    (std::uint16_t, ambient, ambient)
+    (std::uint32_t, range, range)
+)
+
+namespace pandar_ros {
+struct EIGEN_ALIGN16 Point
+{
+    PCL_ADD_POINT4D;
+    float intensity;
+    double timestamp;
+    uint16_t ring;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+}  // namespace pandar_ros
+POINT_CLOUD_REGISTER_POINT_STRUCT(pandar_ros::Point,
+    (float, x, x)
+    (float, y, y)
+    (float, z, z)
+    (float, intensity, intensity)
+    (double, timestamp, timestamp)
+    (std::uint16_t, ring, ring)
+)
+
+namespace robosense_ros {
+struct EIGEN_ALIGN16 Point
+{
+    PCL_ADD_POINT4D;
+    std::uint8_t intensity;
+    std::uint16_t ring;
+    double timestamp;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+}  // namespace robosense_ros
+POINT_CLOUD_REGISTER_POINT_STRUCT(robosense_ros::Point,
+    (float, x, x)
+    (float, y, y)
+    (float, z, z)
+    (std::uint8_t, intensity, intensity)
+    (std::uint16_t, ring, ring)
+    (double, timestamp, timestamp)
+)
+
+namespace {
+
+const int N_SCANS = 32;
+const double BLIND = 0.5, STAMP = 100.0;
+
+/*
+ * A spinning scan of 36 rings, 4 of them beyond N_SCANS, column by column. Some points are NaN or within the
+ * blind distance. set_time gets each point and its column, 0 to columns - 1.
+ */
+template<typename DriverPoint, typename SetTime>
+pcl::PointCloud<DriverPoint> spinning_scan(int columns, unsigned seed, SetTime set_time) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> range(1.0f, 60.0f), unit(0.0f, 1.0f);
+    pcl::PointCloud<DriverPoint> cloud;
+    for (int c = 0; c < columns; c++) {
+        float azimuth = 2.0f * float(M_PI) * c / columns;
+        for (int ring = 0; ring < N_SCANS + 4; ring++) {
+            // smooth walls with the odd jump, so that feature extraction finds planes and edges
+            float r = 15.0f + 5.0f * sinf(3.0f * azimuth + 0.1f * ring), elevation = (ring - 16) * 0.02f;
+            if (unit(gen) < 0.05f) r = range(gen);
+            if (unit(gen) < 0.02f) r = 0.3f;
+            DriverPoint p;
+            p.x = r * cosf(elevation) * cosf(azimuth);
+            p.y = r * cosf(elevation) * sinf(azimuth);
+            p.z = r * sinf(elevation);
+            if (unit(gen) < 0.01f) p.x = NAN;
+            p.intensity = decltype(p.intensity)(unit(gen) * 200.0f);
+            p.ring = ring;
+            set_time(p, c);
+            cloud.push_back(p);
+        }
+    }
+    return cloud;
+}
+
+template<typename DriverPoint>
+sensor_msgs::msg::PointCloud2::UniquePtr to_msg(const pcl::PointCloud<DriverPoint> &cloud) {
+    sensor_msgs::msg::PointCloud2::UniquePtr msg(new sensor_msgs::msg::PointCloud2);
+    pcl::toROSMsg(cloud, *msg);
+    msg->header.stamp.sec = int32_t(STAMP);
+    msg->header.stamp.nanosec = 0;
+    return msg;
+}
+
+/* The filtering of the old handlers on the fromROSMsg cloud, offset_ms gives the time of point i in ms */
+template<typename DriverPoint, typename OffsetMs>
+PointVector reference_decode(const sensor_msgs::msg::PointCloud2 &msg, int point_filter_num, OffsetMs offset_ms) {
+    pcl::PointCloud<DriverPoint> pl_orig;
+    pcl::fromROSMsg(msg, pl_orig);
+    PointVector points;
+    for (size_t i = 0; i < pl_orig.size(); i++) {
+        if (i % point_filter_num != 0) continue;
+        const DriverPoint &q = pl_orig.points[i];
+        PointType p;
+        p.x = q.x;
+        p.y = q.y;
+        p.z = q.z;
+        p.intensity = q.intensity;
+        p.normal_x = p.normal_y = p.normal_z = 0;
+        p.curvature = offset_ms(pl_orig, i);
+        double dist = p.x * p.x + p.y * p.y + p.z * p.z;
+        if (dist < BLIND * BLIND || isnan(p.x) || isnan(p.y) || isnan(p.z)) continue;
+        if (q.ring < N_SCANS) points.push_back(p);
+    }
+    return points;
+}
+
+void expect_same_points(const PointVector &points, const PointVector &expected) {
+    ASSERT_EQ(points.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        EXPECT_EQ(points[i].x, expected[i].x) << "point " << i;
+        EXPECT_EQ(points[i].y, expected[i].y) << "point " << i;
+        EXPECT_EQ(points[i].z, expected[i].z) << "point " << i;
+        EXPECT_EQ(points[i].intensity, expected[i].intensity) << "point " << i;
+        EXPECT_FLOAT_EQ(points[i].curvature, expected[i].curvature) << "point " << i;
+    }
+}
+
+/* VELO and OUSTER scans go through process() */
+PointVector process_scan(int lidar_type, const sensor_msgs::msg::PointCloud2::UniquePtr &msg, int point_filter_num) {
+    Preprocess pre;
+    pre.set(false, lidar_type, BLIND, point_filter_num);
+    pre.N_SCANS = N_SCANS;
+    PointCloudXYZI::Ptr out(new PointCloudXYZI);
+    pre.process(msg, out);
+    return PointVector(out->points.begin(), out->points.end());
+}
+
+/*
+ * PANDAR and ROBOSENSE scans only go through process_cut_frame_pcl2. Cut into a single frame, it returns the
+ * decoded points sorted by offset time without the first one, so the reference is treated alike
+ */
+PointVector process_cut_scan(int lidar_type, const sensor_msgs::msg::PointCloud2::UniquePtr &msg,
+                             int point_filter_num, PointVector &expected) {
+    Preprocess pre;
+    pre.set(false, lidar_type, BLIND, point_filter_num);
+    pre.N_SCANS = N_SCANS;
+    deque<PointCloudXYZI::Ptr> frames;
+    deque<double> frame_times;
+    pre.process_cut_frame_pcl2(msg, frames, frame_times, 1, 0);
+    std::stable_sort(expected.begin(), expected.end(),
+                     [](const PointType &a, const PointType &b) { return a.curvature < b.curvature; });
+    if (!expected.empty()) expected.erase(expected.begin());
+    if (frames.size() != 1) return PointVector();
+    return PointVector(frames[0]->points.begin(), frames[0]->points.end());
+}
+
+TEST(Preprocess, YawDegWithinBound) {
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> coord(-100.0f, 100.0f);
+    // not a multiple of the vector width, so that the scalar tail runs too
+    int n = 100003;
+    vector<float> x(n), y(n), yaw(n);
+    for (int i = 0; i < n; i++) {
+        x[i] = coord(gen);
+        y[i] = coord(gen);
+        if (i % 1000 == 0) x[i] = 0.0f;
+        if (i % 1001 == 0) y[i] = -0.0f;
+        if (i % 1003 == 0) x[i] *= 1e-30f;
+    }
+    // the axes, both signs of zero and the branch cut at +-180 degrees
+    const float edges[][2] = {{0, 0}, {-0.0f, 0}, {0, -0.0f}, {-1, 0}, {-1, -0.0f}, {-1, 1e-30f}, {-1, -1e-30f},
+                              {1, 0}, {0, 1}, {0, -1}, {1, 1}, {-1, -1}, {1e-30f, 1e30f}, {1e30f, 1e-30f}};
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+        x[i] = edges[i][0];
+        y[i] = edges[i][1];
+    }
+    yaw_deg(x.data(), y.data(), n, yaw.data());
+    double max_err = 0.0;
+    for (int i = 0; i < n; i++) {
+        double expected = atan2(double(y[i]), double(x[i])) * 57.2957;
+        EXPECT_NEAR(yaw[i], expected, 1e-3) << "x " << x[i] << ", y " << y[i];
+        max_err = max(max_err, fabs(yaw[i] - expected));
+    }
+    RecordProperty("max_error_deg", std::to_string(max_err));
+}
+
+TEST(Preprocess, DecodeVelodyneMatchesFromROSMsg) {
+    auto cloud = spinning_scan<velodyne_ros::Point>(1800, 2, [](velodyne_ros::Point &p, int c) {
+        p.time = c * (0.1f / 1800);
+    });
+    auto msg = to_msg(cloud);
+    for (int point_filter_num : {1, 3}) {
+        PointVector expected = reference_decode<velodyne_ros::Point>(
+                *msg, point_filter_num,
+                [](const pcl::PointCloud<velodyne_ros::Point> &pl, size_t i) { return pl.points[i].time * 1000.0; });
+        expect_same_points(process_scan(VELO, msg, point_filter_num), expected);
+    }
+}
+
+TEST(Preprocess, DecodeConvertedFieldTypesMatchesFromROSMsg) {
+    auto cloud = spinning_scan<velodyne_wide_ros::Point>(1800, 3, [](velodyne_wide_ros::Point &p, int c) {
+        p.time = c * (0.1 / 1800);
+    });
+    auto msg = to_msg(cloud);
+    PointVector expected = reference_decode<velodyne_wide_ros::Point>(
+            *msg, 2, [](const pcl::PointCloud<velodyne_wide_ros::Point> &pl, size_t i) {
+                return pl.points[i].time * 1000.0;
+            });
+    expect_same_points(process_scan(VELO, msg, 2), expected);
+}
+
+TEST(Preprocess, DecodeOusterMatchesFromROSMsg) {
+    auto cloud = spinning_scan<ouster_ros::Point>(1024, 4, [](ouster_ros::Point &p, int c) {
+        p.t = uint32_t(c) * 97656u;
+        p.reflectivity = p.ambient = 7;
+        p.range = 1000;
+    });
+    auto msg = to_msg(cloud);
+    for (int point_filter_num : {1, 3}) {
+        PointVector expected = reference_decode<ouster_ros::Point>(
+                *msg, point_filter_num,
+                [](const pcl::PointCloud<ouster_ros::Point> &pl, size_t i) { return pl.points[i].t / 1e6; });
+        expect_same_points(process_scan(OUSTER, msg, point_filter_num), expected);
+    }
+}
+
+TEST(Preprocess, DecodePandarMatchesFromROSMsg) {
+    // every point has its own time, so the sort by offset time has no ties
+    int index = 0;
+    auto cloud = spinning_scan<pandar_ros::Point>(1800, 5, [&index](pandar_ros::Point &p, int) {
+        p.timestamp = STAMP - 0.1 + 1e-6 * index++;
+    });
+    auto msg = to_msg(cloud);
+    PointVector expected = reference_decode<pandar_ros::Point>(
+            *msg, 2, [](const pcl::PointCloud<pandar_ros::Point> &pl, size_t i) {
+                return (pl.points[i].timestamp - pl.points[0].timestamp) * 1000;
+            });
+    PointVector points = process_cut_scan(PANDAR, msg, 2, expected);
+    expect_same_points(points, expected);
+}
+
+TEST(Preprocess, DecodeRobosenseMatchesFromROSMsg) {
+    int index = 0;
+    auto cloud = spinning_scan<robosense_ros::Point>(1800, 6, [&index](robosense_ros::Point &p, int) {
+        p.timestamp = STAMP - 0.1 + 1e-6 * index++;
+    });
+    auto msg = to_msg(cloud);
+    double stamp = rclcpp::Time(msg->header.stamp).seconds();
+    PointVector expected = reference_decode<robosense_ros::Point>(
+            *msg, 2, [stamp](const pcl::PointCloud<robosense_ros::Point> &pl, size_t i) {
+                return (pl.points[i].timestamp - stamp + 0.1) * 1000.0;
+            });
+    PointVector points = process_cut_scan(ROBOSENSE, msg, 2, expected);
+    expect_same_points(points, expected);
+}
+
+TEST(Preprocess, ParallelFeaturesMatchRingByRing) {
+    auto cloud = spinning_scan<velodyne_ros::Point>(1800, 7, [](velodyne_ros::Point &p, int c) {
+        p.time = c * (0.1f / 1800);
+    });
+    // process() converts the feature thresholds in place, so every run gets a fresh Preprocess
+    auto extract = [](const pcl::PointCloud<velodyne_ros::Point> &scan, PointVector &surf, PointVector &corn) {
+        Preprocess pre;
+        pre.set(true, VELO, BLIND, 2);
+        pre.N_SCANS = N_SCANS;
+        PointCloudXYZI::Ptr out(new PointCloudXYZI);
+        pre.process(to_msg(scan), out);
+        surf.insert(surf.end(), out->points.begin(), out->points.end());
+        corn.insert(corn.end(), pre.pl_corn.points.begin(), pre.pl_corn.points.end());
+    };
+    PointVector surf, corn, ring_surf, ring_corn;
+    extract(cloud, surf, corn);
+    for (int ring = 0; ring < N_SCANS; ring++) {
+        pcl::PointCloud<velodyne_ros::Point> ring_cloud;
+        for (const velodyne_ros::Point &p : cloud.points)
+            if (p.ring == ring) ring_cloud.push_back(p);
+        extract(ring_cloud, ring_surf, ring_corn);
+    }
+    EXPECT_GT(surf.size(), 0u);
+    expect_same_points(surf, ring_surf);
+    expect_same_points(corn, ring_corn);
+}
+
+}  // namespace